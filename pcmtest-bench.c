@@ -0,0 +1,562 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Throughput benchmark of the virtual pcm test driver (snd-pcmtest) and the PCM middle layer.
+ *
+ * It moves a fixed count of frames through the first substream of the device in every access
+ * mode, format and channel count, and prints the results as JSON, so they can be compared
+ * between the kernel versions:
+ *
+ *	pcmtest-bench [-D device] [-f frames] [-r rate] [-m free|accel|realtime] [-s scale]
+ *
+ * In the 'accel' mode the pointer moves at 'scale' percents of the rate (the 'rate_scale'
+ * debugfs file). The driver can't move the pointer by more than the buffer size per tick, so
+ * in the 'free' mode the scale is calculated from the tick of the device profile to move the
+ * pointer by FREE_RUN_FILL percents of the buffer per tick. Only the benchmarked substreams
+ * are affected, and their previous settings are restored on exit, including the termination
+ * by a signal.
+ *
+ * Build: make bench
+ */
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+#include <alsa/asoundlib.h>
+
+#define DEBUG_DIR "/sys/kernel/debug/pcmtest"
+#define BUFFER_FRAMES 16384
+#define FREE_RUN_FILL 75
+#define DEFAULT_TICK_MS 200
+#define MAX_CHANNELS 4
+#define MAX_SAVED 2
+
+enum bench_mode {
+	MODE_REALTIME,
+	MODE_ACCEL,
+	MODE_FREE,
+};
+
+static const char * const mode_names[] = {
+	[MODE_REALTIME] = "realtime",
+	[MODE_ACCEL] = "accel",
+	[MODE_FREE] = "free",
+};
+
+static const snd_pcm_access_t accesses[] = {
+	SND_PCM_ACCESS_RW_INTERLEAVED,
+	SND_PCM_ACCESS_RW_NONINTERLEAVED,
+	SND_PCM_ACCESS_MMAP_INTERLEAVED,
+	SND_PCM_ACCESS_MMAP_NONINTERLEAVED,
+};
+
+static const snd_pcm_format_t formats[] = {
+	SND_PCM_FORMAT_U8,
+	SND_PCM_FORMAT_S16_LE,
+};
+
+static const unsigned int channel_counts[] = { 1, 2, 4 };
+
+struct bench_params {
+	int card;
+	int device;
+	unsigned long frames;
+	unsigned int rate;
+	enum bench_mode mode;
+	unsigned int scale;
+};
+
+struct bench_result {
+	double elapsed;				// Seconds
+	double cpu_ms;				// Process CPU, including the syscalls
+	double softirq_ms;			// All CPUs, the driver timer runs there
+	long wakeups;				// Voluntary context switches
+	unsigned int xruns;
+	int err;
+};
+
+static double ts_ms(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0;
+}
+
+static double clock_ms(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts_ms(&ts);
+}
+
+// Time spent in softirq by all CPUs, in ms. The resolution is one USER_HZ tick.
+static double softirq_ms(void)
+{
+	unsigned long long user, nice, system, idle, iowait, irq, softirq = 0;
+	FILE *f = fopen("/proc/stat", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle,
+		   &iowait, &irq, &softirq) != 7)
+		softirq = 0;
+	fclose(f);
+	return softirq * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+static long voluntary_switches(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_nvcsw;
+}
+
+// The debugfs files changed by the benchmark and their previous values
+static struct {
+	char path[96];
+	char old[32];
+} saved[MAX_SAVED];
+static volatile sig_atomic_t saved_cnt;
+
+// Only the plain syscalls are used here, as the settings are restored from the signal handler
+static int write_file(const char *path, const char *val)
+{
+	int fd = open(path, O_WRONLY);
+	ssize_t len = strlen(val);
+	int err;
+
+	if (fd < 0)
+		return -1;
+	err = write(fd, val, len) != len;
+	return close(fd) || err ? -1 : 0;
+}
+
+static void restore_files(void)
+{
+	while (saved_cnt > 0) {
+		saved_cnt--;
+		write_file(saved[saved_cnt].path, saved[saved_cnt].old);
+	}
+}
+
+static void restore_on_signal(int sig)
+{
+	restore_files();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+// Set the debugfs file of the first substream, and remember the previous value
+static int set_sub_file(int device, snd_pcm_stream_t stream, const char *name, const char *val)
+{
+	char *path, *old;
+	FILE *f;
+
+	if (saved_cnt >= MAX_SAVED)
+		return -1;
+	path = saved[saved_cnt].path;
+	old = saved[saved_cnt].old;
+	snprintf(path, sizeof(saved[0].path), DEBUG_DIR "/pcm%d%c/sub0/%s", device,
+		 stream == SND_PCM_STREAM_PLAYBACK ? 'p' : 'c', name);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(old, sizeof(saved[0].old), f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	saved_cnt++;
+	return write_file(path, val);
+}
+
+static int find_card(void)
+{
+	char *card_name;
+	int card = -1;
+	int found;
+
+	while (snd_card_next(&card) >= 0) {
+		if (card == -1)
+			break;
+		if (snd_card_get_name(card, &card_name) < 0)
+			continue;
+		found = !strcmp(card_name, "PCM-Test");
+		free(card_name);
+		if (found)
+			break;
+	}
+	return card;
+}
+
+static int setup_handle(snd_pcm_t **handle, struct bench_params *bp, snd_pcm_stream_t stream,
+			snd_pcm_access_t access, snd_pcm_format_t format, unsigned int channels,
+			snd_pcm_uframes_t *period_size)
+{
+	snd_pcm_uframes_t buffer_size = BUFFER_FRAMES;
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_hw_params_t *hwparams;
+	unsigned int rate = bp->rate;
+	char pcm_name[32];
+	int err;
+
+	snd_pcm_sw_params_alloca(&swparams);
+	snd_pcm_hw_params_alloca(&hwparams);
+	*period_size = 4096;
+
+	sprintf(pcm_name, "hw:%d,%d,0", bp->card, bp->device);
+	err = snd_pcm_open(handle, pcm_name, stream, 0);
+	if (err < 0)
+		return err;
+	snd_pcm_hw_params_any(*handle, hwparams);
+	snd_pcm_hw_params_set_rate_resample(*handle, hwparams, 0);
+	snd_pcm_hw_params_set_access(*handle, hwparams, access);
+	snd_pcm_hw_params_set_format(*handle, hwparams, format);
+	snd_pcm_hw_params_set_channels(*handle, hwparams, channels);
+	snd_pcm_hw_params_set_rate_near(*handle, hwparams, &rate, 0);
+	snd_pcm_hw_params_set_period_size_near(*handle, hwparams, period_size, 0);
+	snd_pcm_hw_params_set_buffer_size_near(*handle, hwparams, &buffer_size);
+	err = snd_pcm_hw_params(*handle, hwparams);
+	if (err < 0)
+		goto err_close;
+
+	snd_pcm_sw_params_current(*handle, swparams);
+	snd_pcm_sw_params_set_avail_min(*handle, swparams, *period_size);
+	err = snd_pcm_sw_params(*handle, swparams);
+	if (err < 0)
+		goto err_close;
+	return 0;
+
+err_close:
+	snd_pcm_close(*handle);
+	return err;
+}
+
+static snd_pcm_sframes_t mmap_chunk(snd_pcm_t *handle, snd_pcm_stream_t stream,
+				    snd_pcm_access_t access, unsigned char **bufs,
+				    unsigned int channels, size_t sample_size,
+				    snd_pcm_uframes_t frames)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, size = frames;
+	snd_pcm_sframes_t avail;
+	unsigned char *dma;
+	unsigned int ch;
+	int err;
+
+	avail = snd_pcm_avail_update(handle);
+	if (avail < 0)
+		return avail;
+	if ((snd_pcm_uframes_t)avail < frames) {
+		if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+			err = snd_pcm_start(handle);
+			if (err < 0)
+				return err;
+		}
+		err = snd_pcm_wait(handle, 1000);
+		return err < 0 ? err : 0;
+	}
+
+	err = snd_pcm_mmap_begin(handle, &areas, &offset, &size);
+	if (err < 0)
+		return err;
+	for (ch = 0; ch < channels; ch++) {
+		dma = (unsigned char *)areas[ch].addr + areas[ch].first / 8 +
+		      offset * areas[ch].step / 8;
+		if (access == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+			if (stream == SND_PCM_STREAM_PLAYBACK)
+				memcpy(dma, bufs[0], size * channels * sample_size);
+			else
+				memcpy(bufs[0], dma, size * channels * sample_size);
+			break;
+		}
+		if (stream == SND_PCM_STREAM_PLAYBACK)
+			memcpy(dma, bufs[ch], size * sample_size);
+		else
+			memcpy(bufs[ch], dma, size * sample_size);
+	}
+	return snd_pcm_mmap_commit(handle, offset, size);
+}
+
+// Move one period at a time, the content of the buffers doesn't matter here
+static snd_pcm_sframes_t transfer_chunk(snd_pcm_t *handle, snd_pcm_stream_t stream,
+					snd_pcm_access_t access, unsigned char **bufs,
+					unsigned int channels, size_t sample_size,
+					snd_pcm_uframes_t frames)
+{
+	switch (access) {
+	case SND_PCM_ACCESS_RW_INTERLEAVED:
+		if (stream == SND_PCM_STREAM_PLAYBACK)
+			return snd_pcm_writei(handle, bufs[0], frames);
+		return snd_pcm_readi(handle, bufs[0], frames);
+	case SND_PCM_ACCESS_RW_NONINTERLEAVED:
+		if (stream == SND_PCM_STREAM_PLAYBACK)
+			return snd_pcm_writen(handle, (void **)bufs, frames);
+		return snd_pcm_readn(handle, (void **)bufs, frames);
+	default:
+		return mmap_chunk(handle, stream, access, bufs, channels, sample_size, frames);
+	}
+}
+
+static void run_bench(struct bench_params *bp, snd_pcm_stream_t stream, snd_pcm_access_t access,
+		      snd_pcm_format_t format, unsigned int channels, struct bench_result *res)
+{
+	size_t sample_size = snd_pcm_format_physical_width(format) / 8;
+	unsigned char *bufs[MAX_CHANNELS] = { NULL };
+	snd_pcm_uframes_t period_size, done = 0, chunk;
+	double start, cpu_start, softirq_start;
+	snd_pcm_sframes_t moved;
+	snd_pcm_t *handle;
+	long wakeups_start;
+	unsigned int ch;
+
+	memset(res, 0, sizeof(*res));
+	res->err = setup_handle(&handle, bp, stream, access, format, channels, &period_size);
+	if (res->err)
+		return;
+	// The interleaved modes use the first buffer for all the channels
+	for (ch = 0; ch < channels; ch++) {
+		bufs[ch] = calloc(period_size * channels, sample_size);
+		if (!bufs[ch]) {
+			res->err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	start = clock_ms(CLOCK_MONOTONIC);
+	cpu_start = clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+	softirq_start = softirq_ms();
+	wakeups_start = voluntary_switches();
+	while (done < bp->frames) {
+		chunk = bp->frames - done < period_size ? bp->frames - done : period_size;
+		moved = transfer_chunk(handle, stream, access, bufs, channels, sample_size, chunk);
+		if (moved == -EPIPE) {
+			res->xruns++;
+			moved = snd_pcm_prepare(handle);
+		}
+		if (moved < 0) {
+			res->err = moved;
+			goto out;
+		}
+		done += moved;
+	}
+	if (stream == SND_PCM_STREAM_PLAYBACK) {
+		if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED)
+			snd_pcm_start(handle);
+		snd_pcm_drain(handle);
+	}
+	res->elapsed = (clock_ms(CLOCK_MONOTONIC) - start) / 1000;
+	res->cpu_ms = clock_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	res->softirq_ms = softirq_ms() - softirq_start;
+	res->wakeups = voluntary_switches() - wakeups_start;
+out:
+	for (ch = 0; ch < channels; ch++)
+		free(bufs[ch]);
+	snd_pcm_close(handle);
+}
+
+static const char *access_name(snd_pcm_access_t access)
+{
+	switch (access) {
+	case SND_PCM_ACCESS_RW_INTERLEAVED:
+		return "rw_interleaved";
+	case SND_PCM_ACCESS_RW_NONINTERLEAVED:
+		return "rw_noninterleaved";
+	case SND_PCM_ACCESS_MMAP_INTERLEAVED:
+		return "mmap_interleaved";
+	default:
+		return "mmap_noninterleaved";
+	}
+}
+
+static void print_result(struct bench_params *bp, snd_pcm_stream_t stream,
+			 snd_pcm_access_t access, snd_pcm_format_t format, unsigned int channels,
+			 const struct bench_result *res, int first)
+{
+	double mb = (double)bp->frames * channels * snd_pcm_format_physical_width(format) / 8 /
+		    (1024 * 1024);
+
+	printf("%s\t\t{\"stream\": \"%s\", \"access\": \"%s\", \"format\": \"%s\", ",
+	       first ? "" : ",\n", stream == SND_PCM_STREAM_PLAYBACK ? "playback" : "capture",
+	       access_name(access), snd_pcm_format_name(format));
+	printf("\"channels\": %u, ", channels);
+	if (res->err || res->elapsed <= 0) {
+		printf("\"error\": %d}", res->err);
+		return;
+	}
+	printf("\"mb_per_s\": %.3f, \"frames_per_s\": %.0f, ", mb / res->elapsed,
+	       bp->frames / res->elapsed);
+	printf("\"cpu_ms_per_mb\": %.4f, \"softirq_ms_per_mb\": %.4f, ", res->cpu_ms / mb,
+	       res->softirq_ms / mb);
+	printf("\"wakeups_per_s\": %.1f, \"xruns\": %u}", res->wakeups / res->elapsed, res->xruns);
+}
+
+// Timer ticks of the driver hardware profiles, see 'pcmtst_profiles' in the driver
+static const struct {
+	const char *name;
+	unsigned int tick_ms;
+} profile_ticks[] = {
+	{ "default", 200 },
+	{ "low_latency", 1 },
+	{ "deep_buffer", 50 },
+	{ "multichannel", 10 },
+};
+
+// The module is called snd-pcmtest in the kernel tree and pcmtest when it is built out of tree
+static const char * const profile_params[] = {
+	"/sys/module/snd_pcmtest/parameters/pcm_profiles",
+	"/sys/module/pcmtest/parameters/pcm_profiles",
+};
+
+static unsigned int profile_tick_ms(int device)
+{
+	char line[256], *name, *pos;
+	size_t i;
+	FILE *f;
+	int dev;
+
+	for (i = 0; i < sizeof(profile_params) / sizeof(profile_params[0]); i++) {
+		f = fopen(profile_params[i], "r");
+		if (f)
+			break;
+	}
+	if (!f)
+		return DEFAULT_TICK_MS;
+	if (!fgets(line, sizeof(line), f))
+		line[0] = '\0';
+	fclose(f);
+
+	pos = line;
+	for (dev = 0; (name = strsep(&pos, ",\n")); dev++) {
+		if (dev != device)
+			continue;
+		for (i = 0; i < sizeof(profile_ticks) / sizeof(profile_ticks[0]); i++)
+			if (!strcmp(name, profile_ticks[i].name))
+				return profile_ticks[i].tick_ms;
+	}
+	return DEFAULT_TICK_MS;
+}
+
+// The previous settings are restored by restore_files
+static int set_mode(struct bench_params *bp)
+{
+	unsigned long long free_scale;
+	char scale[16];
+	int err = 0;
+
+	switch (bp->mode) {
+	case MODE_FREE:
+		free_scale = FREE_RUN_FILL * BUFFER_FRAMES * 1000ULL /
+			     ((unsigned long long)bp->rate * profile_tick_ms(bp->device));
+		bp->scale = free_scale ? free_scale : 1;
+		/* fallthrough */
+	case MODE_ACCEL:
+		snprintf(scale, sizeof(scale), "%u", bp->scale);
+		err = set_sub_file(bp->device, SND_PCM_STREAM_PLAYBACK, "rate_scale", scale);
+		err |= set_sub_file(bp->device, SND_PCM_STREAM_CAPTURE, "rate_scale", scale);
+		break;
+	case MODE_REALTIME:
+		break;
+	}
+	return err;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-D device] [-f frames] [-r rate] [-m free|accel|realtime] [-s scale]\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	static const snd_pcm_stream_t streams[] = {
+		SND_PCM_STREAM_PLAYBACK,
+		SND_PCM_STREAM_CAPTURE,
+	};
+	struct bench_params bp = {
+		.frames = 480000,
+		.rate = 48000,
+		.mode = MODE_FREE,
+		.scale = 200,
+	};
+	struct bench_result res;
+	size_t s, a, f, c;
+	struct utsname uts;
+	int opt, first = 1;
+
+	while ((opt = getopt(argc, argv, "D:f:r:m:s:")) != -1) {
+		switch (opt) {
+		case 'D':
+			bp.device = atoi(optarg);
+			break;
+		case 'f':
+			bp.frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			bp.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			for (bp.mode = MODE_REALTIME; bp.mode <= MODE_FREE; bp.mode++)
+				if (!strcmp(optarg, mode_names[bp.mode]))
+					break;
+			if (bp.mode > MODE_FREE) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			bp.scale = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!bp.frames || !bp.rate || !bp.scale) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	bp.card = find_card();
+	if (bp.card < 0) {
+		fprintf(stderr, "Can't find the pcmtest card. Probably, module isn't loaded\n");
+		return 1;
+	}
+	atexit(restore_files);
+	signal(SIGINT, restore_on_signal);
+	signal(SIGTERM, restore_on_signal);
+	signal(SIGHUP, restore_on_signal);
+	if (set_mode(&bp)) {
+		fprintf(stderr, "Can't set the %s mode, this benchmark needs root and debugfs\n",
+			mode_names[bp.mode]);
+		return 1;
+	}
+
+	uname(&uts);
+	printf("{\n\t\"kernel\": \"%s\",\n\t\"mode\": \"%s\",\n", uts.release, mode_names[bp.mode]);
+	printf("\t\"scale\": %u,\n\t\"rate\": %u,\n\t\"frames\": %lu,\n", bp.scale, bp.rate,
+	       bp.frames);
+	printf("\t\"results\": [\n");
+	for (s = 0; s < sizeof(streams) / sizeof(streams[0]); s++) {
+		for (a = 0; a < sizeof(accesses) / sizeof(accesses[0]); a++) {
+			for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+				for (c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]);
+				     c++) {
+					run_bench(&bp, streams[s], accesses[a], formats[f],
+						  channel_counts[c], &res);
+					print_result(&bp, streams[s], accesses[a], formats[f],
+						     channel_counts[c], &res, first);
+					first = 0;
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	printf("\n\t]\n}\n");
+	return 0;
+}
@@ -14,10 +14,32 @@
  *	- Inject delays into the playback and capturing processes. See 'inject_delay' parameter.
  *	- Inject errors during the PCM callbacks.
  *	- Register custom RESET ioctl and notify when it is called through the debugfs entry
+ *	- Monitor the application headroom (distance between appl_ptr and hw_ptr) per substream
+ *	- Measure the application wakeup latency (period elapsed -> appl_ptr update) per substream
+ *	- Count the PCM ioctl and callback calls, and the time spent in the ioctls per substream
+ *	- Export the per-substream statistics through the read-only mmap-able binary page
+ *	- Stream the binary records about the PCM events (periods, xruns, triggers, ...)
+ *	- Report the details about the playback data corruption per substream
+ *	- Generate and check the frame sequence numbers to detect dropped and duplicated frames
+ *	- Calculate CRC32C of every played period, so any content can be verified
+ *	- Stream the played audio to the userspace through the relay channel (playback tap)
+ *	- Capture the audio provided by the userspace through the mmap-able ring buffer
+ *	- Execute the scenario of faults and rate changes at exact frame positions
+ *	- Replay the hardware pointer traces recorded on the real devices
+ *	- Expose several PCM devices with different hardware profiles
+ *	- Override the fill mode, delays and errors injection for every substream
+ *	- Generate silence or a constant value with the minimal overhead
+ *	- Pre-render the capture buffer if the patterns fit into it evenly
+ *	- Verify only a part of the played periods at high data rates
+ *	- Switch between the banks of patterns at the exact frame
+ *	- Corrupt the captured data with bit flips, dropped, duplicated and swapped frames
  *	- Work in interleaved and non-interleaved modes
  *	- Support up to 8 substreams
- *	- Support up to 4 channels
- *	- Support framerates from 8 kHz to 48 kHz
+ *	- Support up to 4 PCM devices, every one with its own hardware profile (see 'pcm_profiles'):
+ *		default: U8/S16_LE, 8 kHz - 48 kHz, up to 4 channels
+ *		low_latency: S16_LE, 44.1 kHz and 48 kHz, up to 2 channels, 1 ms tick
+ *		deep_buffer: S16_LE/S32_LE, 8 kHz - 192 kHz, up to 2 channels, 4 MiB buffer
+ *		multichannel: U8/S16_LE/S32_LE, 8 kHz - 384 kHz, up to 32 channels
  *
  * When driver works in the capture mode with multiple channels, it duplicates the looped
  * pattern to each separate channel. For example, if we have 2 channels, format = U8, interleaved
@@ -38,26 +60,120 @@
 #include <linux/platform_device.h>
 #include <linux/timer.h>
 #include <linux/random.h>
+#include <linux/prandom.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/seq_file.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/kfifo.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/crc32c.h>
+#include <linux/relay.h>
+#include <asm/unaligned.h>
 
 #define DEVNAME "pcmtestd"
 #define CARD_NAME "pcm-test-card"
-#define TIMER_PER_SEC 5
-#define TIMER_INTERVAL (HZ / TIMER_PER_SEC)
 #define DELAY_JIFFIES HZ
 #define PLAYBACK_SUBSTREAM_CNT	8
 #define CAPTURE_SUBSTREAM_CNT	8
-#define MAX_CHANNELS_NUM	4
+#define MAX_CHANNELS_NUM	32
+#define MAX_PATTERNS		4
+#define PATTERN_BANKS		4
+#define MAX_PCM_DEVS		4
+
+#define OVERRIDE_NONE		-1
 
 #define DEFAULT_PATTERN		"abacaba"
 #define DEFAULT_PATTERN_LEN	7
 
 #define FILL_MODE_RAND	0
 #define FILL_MODE_PAT	1
+#define FILL_MODE_SEQ	2
+#define FILL_MODE_USER	3
+#define FILL_MODE_CONST	4
 
 #define MAX_PATTERN_LEN 4096
 
+#define MAX_SAMPLE_BYTES	4
+#define MAX_FRAME_BYTES		(MAX_CHANNELS_NUM * MAX_SAMPLE_BYTES)
+
+#define HIST_BUCKETS	32
+
+#define STATS_MAGIC	0x53544350	// 'PCTS'
+#define STATS_VERSION	1
+
+#define SUB_STATE_CLOSED	0
+#define SUB_STATE_OPEN		1
+#define SUB_STATE_RUNNING	2
+
+#define EVENT_RING_RECS	4096
+
+#define EVENT_PERIOD		1	// arg: index of the elapsed period
+#define EVENT_XRUN		2
+#define EVENT_CORRUPTION	3	// arg: frame of the first mismatch (low 32 bits)
+#define EVENT_TRIGGER		4	// arg: SNDRV_PCM_TRIGGER_* command
+#define EVENT_FAULT		5	// arg: FAULT_* code
+#define EVENT_SCENARIO		6	// arg: index of the executed scenario action
+#define EVENT_BANK		7	// arg: new pattern bank
+
+#define FAULT_HW_PARAMS		1
+#define FAULT_PREPARE		2
+#define FAULT_TRIGGER		3
+
+#define CRC_RING_RECS		1024
+#define CRC_ALL_CHANNELS	0xffff	// Interleaved data, all the channels at once
+#define CRC_PARTIAL		BIT(0)	// Some frames of the period weren't committed in time
+
+#define TAP_SUBBUF_SIZE		(256 * 1024)
+#define TAP_SUBBUF_CNT		8
+#define TAP_NONINTERLEAVED	BIT(0)
+
+#define SRC_MAGIC		0x43525350	// 'PSRC'
+#define SRC_VERSION		1
+#define SRC_DATA_OFFSET		PAGE_SIZE
+#define SRC_DATA_SIZE		(1024 * 1024)	// Must be a power of two
+#define SRC_UNDERFLOW_SILENCE	0
+#define SRC_UNDERFLOW_REPEAT	1
+
+#define INJ_RING_RECS		1024
+
+// Capture data corruptions, the random ones go first
+enum {
+	INJ_BIT_FLIP,				// arg: bit in the sample
+	INJ_DROP,
+	INJ_DUP,
+	INJ_SWAP,				// arg: channel swapped with the logged one
+	INJ_RANDOM_CNT,
+	INJ_DC = INJ_RANDOM_CNT,		// arg: DC offset
+};
+
+#define SCENARIO_MAX_ACTIONS	64
+#define SCENARIO_MAX_INPUT	PAGE_SIZE
+
+enum {
+	SCN_XRUN,				// Stop the stream with xrun
+	SCN_STALL,				// arg: ticks without the pointer moving
+	SCN_RATE,				// arg: rate scale in percents
+	SCN_FAIL_TRIGGER,			// Fail the next trigger callback
+	SCN_BANK,				// arg: pattern bank to switch to
+	SCN_ACTION_CNT,
+};
+
+#define TRACE_MAX_SAMPLES	65536
+#define TRACE_MIN_SAMPLES	2
+#define TRACE_MAX_LINE		64
+
+// Pending bank switch: the bank in the low bits, the frame position in the rest
+#define BANK_REQ_BITS		8
+#define BANK_REQ_NONE		U64_MAX
+
+// ioctl1 commands have small sequential numbers, the last slot collects the unknown ones
+#define IOCTL1_CMD_CNT	8
+
 static int index = -1;
 static char *id = "pcmtest";
 static bool enable = true;
@@ -65,8 +181,13 @@ static int inject_delay;
 static bool inject_hwpars_err;
 static bool inject_prepare_err;
 static bool inject_trigger_err;
+static bool playback_crc;
 
 static short fill_mode = FILL_MODE_PAT;
+static int fill_const;
+static unsigned int patt_gen;		// Incremented on every pattern change
+static char *pcm_profiles[MAX_PCM_DEVS] = { "default" };
+static int pcm_devs = 1;
 
 static u8 playback_capture_test;
 static u8 ioctl_reset_test;
@@ -79,7 +200,11 @@ MODULE_PARM_DESC(id, "ID string for " CARD_NAME " soundcard");
 module_param(enable, bool, 0444);
 MODULE_PARM_DESC(enable, "Enable " CARD_NAME " soundcard.");
 module_param(fill_mode, short, 0600);
-MODULE_PARM_DESC(fill_mode, "Buffer fill mode: rand(0) or pattern(1)");
+MODULE_PARM_DESC(fill_mode,
+		 "Buffer fill mode: rand(0), pattern(1), frame sequence(2), userspace source(3) "
+		 "or constant(4)");
+module_param(fill_const, int, 0600);
+MODULE_PARM_DESC(fill_const, "Sample value for the constant fill mode, relative to silence");
 module_param(inject_delay, int, 0600);
 MODULE_PARM_DESC(inject_delay, "Inject delays during playback/capture (in jiffies)");
 module_param(inject_hwpars_err, bool, 0600);
@@ -88,53 +213,631 @@ module_param(inject_prepare_err, bool, 0600);
 MODULE_PARM_DESC(inject_prepare_err, "Inject EINVAL error in the 'prepare' callback");
 module_param(inject_trigger_err, bool, 0600);
 MODULE_PARM_DESC(inject_trigger_err, "Inject EINVAL error in the 'trigger' callback");
+module_param(playback_crc, bool, 0600);
+MODULE_PARM_DESC(playback_crc, "Calculate CRC32C of every played period");
+module_param_array(pcm_profiles, charp, &pcm_devs, 0444);
+MODULE_PARM_DESC(pcm_profiles,
+		 "Hardware profiles of the PCM devices: "
+		 "default, low_latency, deep_buffer or multichannel");
 
-struct pcmtst {
+/*
+ * Log2 histogram. Bucket 0 counts zero values, bucket N counts values in [2^(N-1), 2^N), and the
+ * last bucket also collects everything above its lower bound.
+ */
+struct pcmtst_hist {
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u64 buckets[HIST_BUCKETS];
+};
+
+/*
+ * Binary statistics page, which can be mapped read-only through the 'stats' debugfs file. The
+ * header is followed by rec_count records of rec_size bytes: all playback substreams first,
+ * then all capture substreams. New fields are only appended to the records, and the version
+ * is increased when the meaning of the existing ones changes.
+ *
+ * Every record is updated by a single writer (the substream timer, or open/close when the
+ * timer isn't running) without any locks. The writer makes 'seq' odd before the update and
+ * even after it, so the reader has to retry while 'seq' is odd or has changed during the read.
+ */
+struct pcmtst_stats_hdr {
+	u32 magic;
+	u32 version;
+	u32 hdr_size;
+	u32 rec_size;
+	u32 rec_count;
+	u32 reserved[3];
+};
+
+struct pcmtst_stats_rec {
+	u32 seq;
+	u8 stream;				// SNDRV_PCM_STREAM_*
+	u8 number;				// Substream number
+	u8 state;				// SUB_STATE_*
+	u8 buf_corrupted;			// Playback check has failed
+	u64 ticks;
+	u64 total_bytes;
+	u64 hw_ptr;				// In frames, since the last 'prepare'
+	u64 appl_ptr;
+	u64 periods;
+	u64 pointer_calls;
+	u64 ack_calls;
+	struct pcmtst_hist headroom;
+	struct pcmtst_hist wakeup_lat;
+	u64 first_mismatch_frame;
+	u64 mismatch_bytes;
+	u64 corrupt_periods;
+	u32 device;				// PCM device number
+	u32 reserved;
+};
+
+// Binary record of the 'events' debugfs file
+struct pcmtst_event {
+	u64 ts_ns;				// CLOCK_MONOTONIC
+	u64 hw_ptr;				// In frames, since the last 'prepare'
+	u32 arg;				// Event-specific argument
+	u16 type;				// EVENT_*
+	u8 stream;
+	u8 number;
+	u8 device;
+	u8 reserved[7];
+};
+
+/*
+ * Ring of fixed-size binary records which can be read (and polled) from the userspace. The
+ * consumer side is lockless (kfifo is safe for a single reader and a single writer), the
+ * producers serialize on the short spinlock and never wait for the reader: the records which
+ * don't fit are counted as dropped.
+ */
+struct pcmtst_ring {
+	struct kfifo fifo;
+	spinlock_t lock;			// Serializes the producers
+	struct mutex read_lock;			// Serializes the readers
+	wait_queue_head_t wait;
+	size_t rec_size;
+	u64 dropped;
+	bool closed;
+};
+
+// Playback corruption details since 'open', frames are counted from the last 'prepare'
+struct pcmtst_corruption {
+	u64 first_frame;			// Frame of the first mismatch
+	u32 first_channel;
+	u8 expected;				// Value of the first mismatching byte
+	u8 actual;
+	u64 mismatch_bytes;
+	u64 corrupt_periods;			// Periods which contain at least one mismatch
+	u64 last_period;
+	u64 checked_bytes;
+	u64 unfilled_bytes;			// Not committed by the application in time
+	u64 skipped_bytes;			// Not checked because of the verification policy
+	u64 checked_periods;
+	u64 skipped_periods;
+};
+
+// Results of the frame sequence check (FILL_MODE_SEQ), frames are counted since the 'prepare'
+struct pcmtst_seq_stats {
+	u64 frames;				// Checked frames
+	u64 gaps;				// Sequence jumped forward
+	u64 dropped_frames;			// Total size of the gaps
+	u64 repeats;				// Previous frame is repeated
+	u64 reorders;				// Sequence jumped backward
+	u64 channel_errors;			// Samples with a wrong channel id or frame counter
+	u64 first_gap_frame;
+	u64 first_repeat_frame;
+	u64 first_reorder_frame;
+	u64 first_channel_error_frame;
+	u32 next;				// Expected frame counter
+};
+
+// Binary record of the per-substream 'injected' debugfs file
+struct pcmtst_inj_rec {
+	u64 frame;				// Frame since the last 'prepare'
+	u32 arg;				// INJ_*-specific argument
+	u16 channel;
+	u16 type;				// INJ_*
+};
+
+// Binary record of the per-substream 'crc' debugfs file
+struct pcmtst_crc_rec {
+	u64 period;				// Index of the period since the last 'prepare'
+	u32 crc;				// CRC32C of the period data
+	u16 channel;				// Channel, or CRC_ALL_CHANNELS if interleaved
+	u16 flags;				// CRC_*
+};
+
+/*
+ * Header of every record in the playback tap relay channel. It is followed by 'bytes' bytes of
+ * the played frames: interleaved, or channel by channel in the non-interleaved mode.
+ */
+struct pcmtst_tap_hdr {
+	u64 ts_ns;				// CLOCK_MONOTONIC time of the consumption
+	u64 frame;				// First frame, counted since the last 'prepare'
+	u32 bytes;
+	u16 channels;
+	u16 flags;				// TAP_*
+};
+
+/*
+ * Control page of the userspace capture source (see the 'source' debugfs file). The data area
+ * of SRC_DATA_SIZE bytes starts at SRC_DATA_OFFSET. 'head' and 'tail' are the total counts of
+ * bytes produced by the userspace and consumed by the driver, the position in the data area is
+ * the counter modulo the data size. The data contains interleaved frames in the stream format.
+ */
+struct pcmtst_src_ctl {
+	u32 magic;
+	u32 version;
+	u32 data_offset;
+	u32 data_size;
+	u64 head;				// Written by the userspace
+	u64 tail;				// Written by the driver, never read back
+	u64 underflow_frames;			// Written by the driver
+};
+
+struct pcmtst_scn_action {
+	u64 frame;				// Frame position, counted from the last 'prepare'
+	u32 action;				// SCN_*
+	u32 arg;
+};
+
+// Per-substream values of the module parameters, OVERRIDE_NONE means the global value is used
+struct pcmtst_overrides {
+	int fill_mode;
+	int inject_delay;
+	int inject_hwpars_err;
+	int inject_prepare_err;
+	int inject_trigger_err;
+};
+
+struct pcmtst_trace_smp {
+	u64 usec;				// Timestamp of the sample
+	u64 frame;				// Hardware pointer, not wrapped
+};
+
+struct pcmtst_ioctl_stat {
+	u64 calls;
+	u64 total_ns;
+	u64 max_ns;
+};
+
+/*
+ * Per-substream state which outlives a single open/close cycle, so the collected statistics can
+ * be read through the debugfs after the stream is closed.
+ */
+struct pcmtst_sub {
+	struct pcmtst_hist headroom;		// appl_ptr <-> hw_ptr distance in frames
+	struct pcmtst_hist wakeup_lat;		// period elapsed -> ack latency in usecs
+	struct pcmtst_corruption corruption;
+	struct pcmtst_seq_stats seq;
+	struct pcmtst_ioctl_stat ioctls[IOCTL1_CMD_CNT + 1];
+	u64 pointer_calls;			// Every status/hwsync/sync_ptr query
+	u64 ack_calls;
+	u64 periods;
+	u64 ticks;
+	struct pcmtst_stats_rec *stats_rec;	// Record in the mmap-able statistics page
+	struct pcmtst_ring crc_ring;		// Playback only
+	struct mutex lock;			// Protects 'opened' and the tap channel lifetime
+	bool opened;
+	struct rchan *tap_chan;			// Playback tap, if enabled
+	u64 tap_dropped;			// Bytes which didn't fit into the tap
+	struct pcmtst_src_ctl *src;		// Userspace capture source, allocated on demand
+	u64 src_tail;				// Consumed bytes, published to src->tail
+	u32 src_underflow_mode;			// SRC_UNDERFLOW_*
+	u64 src_underflows;			// Times the source ran dry
+	u64 src_underflow_frames;
+	struct pcmtst_scn_action scenario[SCENARIO_MAX_ACTIONS];
+	unsigned int scenario_len;
+	u32 rate_scale;				// Speed of the pointer in percents of the rate
+	struct pcmtst_trace_smp *trace;		// Recorded pointer trace to replay
+	unsigned int trace_len;
+	int trace_err;				// Result of the last trace load
+	struct pcmtst_overrides ovr;
+	u32 verify_every;			// Verify 1 of N played periods
+	u32 verify_percent;			// Verify the random N percents of periods
+	u32 bank;				// Active pattern bank
+	u64 bank_req;				// Pending switch, BANK_REQ_NONE if there is none
+	u64 bank_switch_frame;			// Frame where the last switch happened
+	u64 bank_switches;
+	u32 inj_rate[INJ_RANDOM_CNT];		// Capture corruption rates, see inj_scale
+	int inj_dc;				// DC offset added to the captured samples
+	u64 inj_seed;
+	struct pcmtst_ring inj_ring;		// Capture only
+	struct dentry *debug_dir;
+};
+
+struct pcmtst_profile {
+	const char *name;
+	struct snd_pcm_hardware hw;
+	unsigned int tick_ms;			// Interval of the timer which moves the pointer
+};
+
+struct pcmtst_dev {
+	struct pcmtst *pcmtst;
 	struct snd_pcm *pcm;
+	const struct pcmtst_profile *profile;
+	struct pcmtst_sub playback_subs[PLAYBACK_SUBSTREAM_CNT];
+	struct pcmtst_sub capture_subs[CAPTURE_SUBSTREAM_CNT];
+	struct dentry *debug_dirs[2];		// pcmNp and pcmNc debugfs directories
+};
+
+struct pcmtst {
 	struct snd_card *card;
 	struct platform_device *pdev;
+	struct pcmtst_dev devs[MAX_PCM_DEVS];
+	int dev_cnt;
+	struct pcmtst_stats_hdr *stats;		// vmalloc'ed statistics page(s)
+	size_t stats_size;
+	struct dentry *stats_file;
+	struct pcmtst_ring events;
+	struct dentry *events_file;
 };
 
 struct pcmtst_buf_iter {
 	size_t buf_pos;				// position in the DMA buffer
 	size_t period_pos;			// period-relative position
-	size_t b_rw;				// Bytes to write on every timer tick
-	size_t s_rw_ch;				// Samples to write to one channel on every tick
+	size_t b_rw;				// Bytes to process in the current block
+	size_t s_rw_ch;				// Samples of one channel in the current block
 	unsigned int sample_bytes;		// sample_bits / 8
+	size_t frame_bytes;			// sample_bytes * channels
 	bool is_buf_corrupted;			// playback test result indicator
+	u64 first_error_frame;			// Frame where the stream got corrupted
+	u32 crc[MAX_CHANNELS_NUM];		// CRC32C of the current period (per channel if NI)
+	bool crc_partial;
+	u8 src_last_frame[MAX_FRAME_BYTES];	// Last frame of the userspace source
+	bool src_last_valid;
+	bool src_underflow;
 	size_t period_bytes;			// bytes in a one period
 	bool interleaved;			// Interleaved/Non-interleaved mode
 	size_t total_bytes;			// Total bytes read/written
 	size_t chan_block;			// Bytes in one channel buffer when non-interleaved
+	struct pcmtst_sub *sub;			// Persistent per-substream statistics
+	unsigned long interval;			// Timer interval in jiffies
+	ktime_t period_ts;			// Time of the last period elapsed event
+	bool ack_pending;			// Waiting for the application to respond
+	bool xrun_reported;			// EVENT_XRUN is sent for the current xrun
+	u64 rate_frac;				// Fractional frames accumulated for the rate scale
+	u32 rate_scale;				// sub->rate_scale at 'prepare', changed by scenario
+	unsigned int scn_pos;			// Next scenario action to execute
+	u32 stall_ticks;
+	bool fail_trigger;
+	bool trace_started;			// The trace replay begins when the stream runs
+	unsigned int trace_idx;			// Next trace sample to reach
+	ktime_t trace_base;			// Time of the first sample in this loop
+	bool prerendered;			// The capture buffer already contains the data
+	size_t verify_period;			// Period of the last verification decision
+	bool verify_cur;			// The decision for this period
+	bool seq_resync;			// The sequence check skipped some frames
+	unsigned int prerender_gen;		// patt_gen at the moment of rendering
+	u32 prerender_bank;
+	u32 start_bank;				// Bank of the substream at 'open'
+	ssize_t gen_shift;			// Generated data position - total_bytes
+	bool inj_active;			// Some capture corruption is enabled
+	struct rnd_state inj_rnd;		// Seeded at 'prepare'
+	u64 inj_next[INJ_RANDOM_CNT];		// Next position, in bits for bit flips
+	u32 inj_rate[INJ_RANDOM_CNT];		// The substream settings at 'prepare'
+	int inj_dc;
 	struct snd_pcm_substream *substream;
 	struct timer_list timer_instance;
 };
 
-static struct snd_pcm_hardware snd_pcmtst_hw = {
-	.info = (SNDRV_PCM_INFO_INTERLEAVED |
-		 SNDRV_PCM_INFO_BLOCK_TRANSFER |
-		 SNDRV_PCM_INFO_NONINTERLEAVED |
-		 SNDRV_PCM_INFO_MMAP_VALID),
-	.formats =		SNDRV_PCM_FMTBIT_U8 | SNDRV_PCM_FMTBIT_S16_LE,
-	.rates =		SNDRV_PCM_RATE_8000_48000,
-	.rate_min =		8000,
-	.rate_max =		48000,
-	.channels_min =		1,
-	.channels_max =		MAX_CHANNELS_NUM,
-	.buffer_bytes_max =	128 * 1024,
-	.period_bytes_min =	4096,
-	.period_bytes_max =	32768,
-	.periods_min =		1,
-	.periods_max =		1024,
+#define PCMTST_HW_INFO (SNDRV_PCM_INFO_INTERLEAVED |		\
+			SNDRV_PCM_INFO_BLOCK_TRANSFER |		\
+			SNDRV_PCM_INFO_NONINTERLEAVED |		\
+			SNDRV_PCM_INFO_MMAP |			\
+			SNDRV_PCM_INFO_MMAP_VALID |		\
+			SNDRV_PCM_INFO_SYNC_APPLPTR)
+
+/*
+ * Every PCM device gets the hardware description and the timer interval from its profile. The
+ * faster streams need the shorter interval, as one tick can't move the pointer by more than
+ * the buffer size.
+ */
+static const struct pcmtst_profile pcmtst_profiles[] = {
+	{
+		.name = "default",
+		.hw = {
+			.info =			PCMTST_HW_INFO,
+			.formats =		SNDRV_PCM_FMTBIT_U8 | SNDRV_PCM_FMTBIT_S16_LE,
+			.rates =		SNDRV_PCM_RATE_8000_48000,
+			.rate_min =		8000,
+			.rate_max =		48000,
+			.channels_min =		1,
+			.channels_max =		MAX_PATTERNS,
+			.buffer_bytes_max =	128 * 1024,
+			.period_bytes_min =	4096,
+			.period_bytes_max =	32768,
+			.periods_min =		1,
+			.periods_max =		1024,
+		},
+		.tick_ms = 200,
+	},
+	{
+		.name = "low_latency",
+		.hw = {
+			.info =			PCMTST_HW_INFO,
+			.formats =		SNDRV_PCM_FMTBIT_S16_LE,
+			.rates =		SNDRV_PCM_RATE_44100 | SNDRV_PCM_RATE_48000,
+			.rate_min =		44100,
+			.rate_max =		48000,
+			.channels_min =		1,
+			.channels_max =		2,
+			.buffer_bytes_max =	16 * 1024,
+			.period_bytes_min =	64,
+			.period_bytes_max =	4096,
+			.periods_min =		2,
+			.periods_max =		64,
+		},
+		.tick_ms = 1,
+	},
+	{
+		.name = "deep_buffer",
+		.hw = {
+			.info =			PCMTST_HW_INFO,
+			.formats =		SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S32_LE,
+			.rates =		SNDRV_PCM_RATE_8000_192000,
+			.rate_min =		8000,
+			.rate_max =		192000,
+			.channels_min =		1,
+			.channels_max =		2,
+			.buffer_bytes_max =	4 * 1024 * 1024,
+			.period_bytes_min =	16 * 1024,
+			.period_bytes_max =	1024 * 1024,
+			.periods_min =		2,
+			.periods_max =		32,
+		},
+		.tick_ms = 50,
+	},
+	{
+		.name = "multichannel",
+		.hw = {
+			.info =			PCMTST_HW_INFO,
+			.formats =		SNDRV_PCM_FMTBIT_U8 | SNDRV_PCM_FMTBIT_S16_LE |
+						SNDRV_PCM_FMTBIT_S32_LE,
+			.rates =		SNDRV_PCM_RATE_8000_384000,
+			.rate_min =		8000,
+			.rate_max =		384000,
+			.channels_min =		1,
+			.channels_max =		MAX_CHANNELS_NUM,
+			.buffer_bytes_max =	4 * 1024 * 1024,
+			.period_bytes_min =	4096,
+			.period_bytes_max =	1024 * 1024,
+			.periods_min =		2,
+			.periods_max =		1024,
+		},
+		.tick_ms = 10,
+	},
 };
 
+static const struct pcmtst_profile *dev_profiles[MAX_PCM_DEVS];
+
 struct pattern_buf {
 	char *buf;
 	u32 len;
 };
 
+// Corruption rates are given per billion bits for the bit flips and per million frames otherwise
+static const u32 inj_scale[INJ_RANDOM_CNT] = {
+	[INJ_BIT_FLIP] = 1000000000,
+	[INJ_DROP] = 1000000,
+	[INJ_DUP] = 1000000,
+	[INJ_SWAP] = 1000000,
+};
+
 static int buf_allocated;
-static struct pattern_buf patt_bufs[MAX_CHANNELS_NUM];
+static struct pattern_buf patt_bufs[PATTERN_BANKS][MAX_PATTERNS];
+
+/*
+ * Pattern of the channel in the active bank of the substream. If there are more channels than
+ * patterns, the patterns are reused.
+ */
+static inline struct pattern_buf *ch_pattern(const struct pcmtst_buf_iter *v_iter,
+					     unsigned int ch)
+{
+	return &patt_bufs[v_iter->sub->bank][ch % buf_allocated];
+}
+
+// The bank doesn't change inside one block, so the patterns are looked up once per block
+static void block_patterns(const struct pcmtst_buf_iter *v_iter, unsigned int channels,
+			   const struct pattern_buf **patts)
+{
+	unsigned int ch;
+
+	for (ch = 0; ch < channels; ch++)
+		patts[ch] = ch_pattern(v_iter, ch);
+}
+
+static void hist_reset(struct pcmtst_hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = U64_MAX;
+}
+
+static void hist_add(struct pcmtst_hist *hist, u64 val)
+{
+	hist->buckets[min_t(int, fls64(val), HIST_BUCKETS - 1)]++;
+	hist->count++;
+	hist->sum += val;
+	if (val < hist->min)
+		hist->min = val;
+	if (val > hist->max)
+		hist->max = val;
+}
+
+static void hist_show(struct seq_file *s, const struct pcmtst_hist *hist, const char *unit)
+{
+	int i;
+
+	seq_printf(s, "samples: %llu\n", hist->count);
+	if (!hist->count)
+		return;
+	seq_printf(s, "min: %llu %s\n", hist->min, unit);
+	seq_printf(s, "avg: %llu %s\n", div64_u64(hist->sum, hist->count), unit);
+	seq_printf(s, "max: %llu %s\n", hist->max, unit);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist->buckets[i])
+			continue;
+		if (i == 0)
+			seq_printf(s, "[0, 1): %llu\n", hist->buckets[i]);
+		else if (i == HIST_BUCKETS - 1)
+			seq_printf(s, "[%llu, inf): %llu\n", 1ULL << (i - 1), hist->buckets[i]);
+		else
+			seq_printf(s, "[%llu, %llu): %llu\n", 1ULL << (i - 1), 1ULL << i,
+				   hist->buckets[i]);
+	}
+}
+
+static int ring_init(struct pcmtst_ring *ring, size_t rec_size, size_t rec_cnt)
+{
+	spin_lock_init(&ring->lock);
+	mutex_init(&ring->read_lock);
+	init_waitqueue_head(&ring->wait);
+	ring->rec_size = rec_size;
+	// The size is a power of two, so there is always room for a whole number of records
+	return kfifo_alloc(&ring->fifo, roundup_pow_of_two(rec_size) * rec_cnt, GFP_KERNEL);
+}
+
+// Wake up the readers and don't let them wait anymore, the ring is going to be freed
+static void ring_close(struct pcmtst_ring *ring)
+{
+	// The ring was never initialized
+	if (!ring->rec_size)
+		return;
+	WRITE_ONCE(ring->closed, true);
+	wake_up_interruptible(&ring->wait);
+}
+
+static void ring_free(struct pcmtst_ring *ring)
+{
+	kfifo_free(&ring->fifo);
+	mutex_destroy(&ring->read_lock);
+}
+
+static void ring_push(struct pcmtst_ring *ring, const void *rec)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ring->lock, flags);
+	if (kfifo_avail(&ring->fifo) < ring->rec_size)
+		ring->dropped++;
+	else
+		kfifo_in(&ring->fifo, rec, ring->rec_size);
+	spin_unlock_irqrestore(&ring->lock, flags);
+
+	if (wq_has_sleeper(&ring->wait))
+		wake_up_interruptible(&ring->wait);
+}
+
+// Read as many whole records as fit into the user buffer
+static ssize_t ring_read(struct file *file, char __user *u_buff, size_t len, loff_t *off)
+{
+	struct pcmtst_ring *ring = file->f_inode->i_private;
+	unsigned int copied;
+	int err;
+
+	len = rounddown(len, ring->rec_size);
+	if (!len)
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&ring->read_lock))
+		return -ERESTARTSYS;
+	while (kfifo_is_empty(&ring->fifo)) {
+		if (READ_ONCE(ring->closed)) {
+			err = 0;
+			goto unlock;
+		}
+		if (file->f_flags & O_NONBLOCK) {
+			err = -EAGAIN;
+			goto unlock;
+		}
+		err = wait_event_interruptible(ring->wait, !kfifo_is_empty(&ring->fifo) ||
+					       READ_ONCE(ring->closed));
+		if (err)
+			goto unlock;
+	}
+	err = kfifo_to_user(&ring->fifo, u_buff, len, &copied);
+	if (!err)
+		err = copied;
+unlock:
+	mutex_unlock(&ring->read_lock);
+	return err;
+}
+
+static __poll_t ring_poll(struct file *file, poll_table *wait)
+{
+	struct pcmtst_ring *ring = file->f_inode->i_private;
+
+	poll_wait(file, &ring->wait, wait);
+	if (!kfifo_is_empty(&ring->fifo) || READ_ONCE(ring->closed))
+		return EPOLLIN | EPOLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations ring_fops = {
+	.owner = THIS_MODULE,
+	.open = nonseekable_open,
+	.read = ring_read,
+	.poll = ring_poll,
+	.llseek = no_llseek,
+};
+
+static void emit_event(struct snd_pcm_substream *substream, u16 type, u32 arg)
+{
+	struct pcmtst_dev *dev = substream->pcm->private_data;
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct pcmtst_buf_iter *v_iter = runtime->private_data;
+	struct pcmtst_event event = {
+		.ts_ns = ktime_get_ns(),
+		.arg = arg,
+		.type = type,
+		.stream = substream->stream,
+		.number = substream->number,
+		.device = substream->pcm->device,
+	};
+
+	if (runtime->frame_bits)
+		event.hw_ptr = bytes_to_frames(runtime, v_iter->total_bytes);
+	ring_push(&dev->pcmtst->events, &event);
+}
+
+static void reset_sub_stats(struct pcmtst_sub *sub)
+{
+	hist_reset(&sub->headroom);
+	hist_reset(&sub->wakeup_lat);
+	memset(&sub->corruption, 0, sizeof(sub->corruption));
+	memset(&sub->seq, 0, sizeof(sub->seq));
+	memset(sub->ioctls, 0, sizeof(sub->ioctls));
+	sub->pointer_calls = 0;
+	sub->ack_calls = 0;
+	sub->periods = 0;
+	sub->ticks = 0;
+	sub->tap_dropped = 0;
+	sub->src_underflows = 0;
+	sub->src_underflow_frames = 0;
+	sub->bank_switches = 0;
+}
+
+static struct pcmtst_sub *get_pcmtst_sub(struct snd_pcm_substream *substream)
+{
+	struct pcmtst_dev *dev = substream->pcm->private_data;
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		return &dev->playback_subs[substream->number];
+	return &dev->capture_subs[substream->number];
+}
+
+static inline int sub_param(const int *ovr, int global)
+{
+	int val = READ_ONCE(*ovr);
+
+	return val == OVERRIDE_NONE ? global : val;
+}
+
+static inline int sub_fill_mode(struct pcmtst_sub *sub)
+{
+	return sub_param(&sub->ovr.fill_mode, fill_mode);
+}
 
 static inline void inc_buf_pos(struct pcmtst_buf_iter *v_iter, size_t by, size_t bytes)
 {
@@ -143,6 +846,15 @@ static inline void inc_buf_pos(struct pcmtst_buf_iter *v_iter, size_t by, size_t
 	v_iter->buf_pos %= bytes;
 }
 
+/*
+ * Position of the pattern and frame sequence generators. The dropped and duplicated frames
+ * shift it, so all the following frames are shifted as well.
+ */
+static inline size_t gen_pos(struct pcmtst_buf_iter *v_iter)
+{
+	return v_iter->total_bytes + v_iter->gen_shift;
+}
+
 /*
  * Position in the DMA buffer when we are in the non-interleaved mode. We increment buf_pos
  * every time we write a byte to any channel, so the position in the current channel buffer is
@@ -164,118 +876,662 @@ static inline size_t ch_pos_i(size_t b_total, unsigned int channels, unsigned in
 	return b_total / channels / b_sample * b_sample + (b_total % b_sample);
 }
 
-static void check_buf_block_i(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+// Address of the sample of the channel 'ch' in the frame at the position 'pos' of the buffer
+static inline u8 *frame_sample_ptr(struct pcmtst_buf_iter *v_iter,
+				   struct snd_pcm_runtime *runtime, size_t pos, unsigned int ch)
+{
+	if (v_iter->interleaved)
+		return runtime->dma_area + pos + ch * v_iter->sample_bytes;
+	return runtime->dma_area + pos / runtime->channels + v_iter->chan_block * ch;
+}
+
+// Address of the sample of the channel 'ch' in the current frame
+static inline u8 *sample_ptr(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			     unsigned int ch)
+{
+	return frame_sample_ptr(v_iter, runtime, v_iter->buf_pos, ch);
+}
+
+// Position of the frame which is 'back' frames behind the current one
+static inline size_t prev_frame_pos(struct pcmtst_buf_iter *v_iter,
+				    struct snd_pcm_runtime *runtime, size_t back)
+{
+	return (v_iter->buf_pos + runtime->dma_bytes - back * v_iter->frame_bytes) %
+	       runtime->dma_bytes;
+}
+
+// All the supported formats are little-endian
+static inline void put_sample(u8 *dst, unsigned int sample_bytes, u32 val)
+{
+	unsigned int i;
+
+	switch (sample_bytes) {
+	case 1:
+		*dst = val;
+		break;
+	case 2:
+		put_unaligned_le16(val, dst);
+		break;
+	case 4:
+		put_unaligned_le32(val, dst);
+		break;
+	default:
+		for (i = 0; i < sample_bytes; i++)
+			dst[i] = val >> (i * 8);
+	}
+}
+
+static inline u32 get_sample(const u8 *src, unsigned int sample_bytes)
+{
+	unsigned int i;
+	u32 val = 0;
+
+	switch (sample_bytes) {
+	case 1:
+		return *src;
+	case 2:
+		return get_unaligned_le16(src);
+	case 4:
+		return get_unaligned_le32(src);
+	default:
+		for (i = 0; i < sample_bytes && i < sizeof(val); i++)
+			val |= (u32)src[i] << (i * 8);
+		return val;
+	}
+}
+
+static inline void mark_corrupted(struct pcmtst_buf_iter *v_iter, u64 frame)
+{
+	if (!v_iter->is_buf_corrupted)
+		v_iter->first_error_frame = frame;
+	v_iter->is_buf_corrupted = true;
+}
+
+/*
+ * Record the mismatching byte. We don't stop checking after the first error, so the statistics
+ * show whether it was a one-off glitch or a systematic problem (like swapped channels).
+ */
+static void report_mismatch(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			    unsigned int ch, u64 frame, u8 expected, u8 actual)
+{
+	struct pcmtst_corruption *corr = &v_iter->sub->corruption;
+	u64 period = div_u64(frame, runtime->period_size);
+
+	if (!corr->mismatch_bytes) {
+		corr->first_frame = frame;
+		corr->first_channel = ch;
+		corr->expected = expected;
+		corr->actual = actual;
+	}
+	if (!corr->mismatch_bytes || period != corr->last_period) {
+		corr->corrupt_periods++;
+		corr->last_period = period;
+	}
+	corr->mismatch_bytes++;
+	mark_corrupted(v_iter, frame);
+}
+
+static void check_buf_block_i(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			      size_t bytes)
 {
+	const struct pattern_buf *patts[MAX_CHANNELS_NUM], *patt;
 	size_t i;
 	short ch_num;
-	u8 current_byte;
+	u8 current_byte, expected_byte;
 
-	for (i = 0; i < v_iter->b_rw; i++) {
+	block_patterns(v_iter, runtime->channels, patts);
+	for (i = 0; i < bytes; i++) {
 		current_byte = runtime->dma_area[v_iter->buf_pos];
-		if (!current_byte)
-			break;
 		ch_num = (v_iter->total_bytes / v_iter->sample_bytes) % runtime->channels;
-		if (current_byte != patt_bufs[ch_num].buf[ch_pos_i(v_iter->total_bytes,
-								   runtime->channels,
-								   v_iter->sample_bytes)
-							  % patt_bufs[ch_num].len]) {
-			v_iter->is_buf_corrupted = true;
-			break;
-		}
+		patt = patts[ch_num];
+		expected_byte = patt->buf[ch_pos_i(v_iter->total_bytes, runtime->channels,
+						   v_iter->sample_bytes) % patt->len];
+		if (current_byte != expected_byte)
+			report_mismatch(v_iter, runtime, ch_num, v_iter->total_bytes /
+					v_iter->sample_bytes / runtime->channels,
+					expected_byte, current_byte);
 		inc_buf_pos(v_iter, 1, runtime->dma_bytes);
 	}
-	// If we broke during the loop, add remaining bytes to the buffer position.
-	inc_buf_pos(v_iter, v_iter->b_rw - i, runtime->dma_bytes);
 }
 
-static void check_buf_block_ni(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+static void check_buf_block_ni(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			       size_t bytes)
 {
 	unsigned int channels = runtime->channels;
+	const struct pattern_buf *patts[MAX_CHANNELS_NUM], *patt;
 	size_t i;
 	short ch_num;
-	u8 current_byte;
+	u8 current_byte, expected_byte;
 
-	for (i = 0; i < v_iter->b_rw; i++) {
+	block_patterns(v_iter, channels, patts);
+	for (i = 0; i < bytes; i++) {
 		current_byte = runtime->dma_area[buf_pos_n(v_iter, channels, i % channels)];
-		if (!current_byte)
-			break;
 		ch_num = i % channels;
-		if (current_byte != patt_bufs[ch_num].buf[(v_iter->total_bytes / channels)
-							  % patt_bufs[ch_num].len]) {
-			v_iter->is_buf_corrupted = true;
-			break;
-		}
+		patt = patts[ch_num];
+		expected_byte = patt->buf[(v_iter->total_bytes / channels) % patt->len];
+		if (current_byte != expected_byte)
+			report_mismatch(v_iter, runtime, ch_num,
+					v_iter->total_bytes / channels / v_iter->sample_bytes,
+					expected_byte, current_byte);
 		inc_buf_pos(v_iter, 1, runtime->dma_bytes);
 	}
-	inc_buf_pos(v_iter, v_iter->b_rw - i, runtime->dma_bytes);
 }
 
 /*
- * Check one block of the buffer. Here we iterate the buffer until we find '0'. This condition is
- * necessary because we need to detect when the reading/writing ends, so we assume that the pattern
- * doesn't contain zeros.
+ * In the frame sequence mode every sample contains the frame counter, shifted left by ch_bits,
+ * and the channel number in the low ch_bits bits (ch_bits = log2(channels), rounded up). The
+ * counter wraps around according to the sample width, so it is 14-bit for 4-channel S16_LE.
  */
-static void check_buf_block(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+static inline u32 seq_sample(u64 frame, unsigned int ch, unsigned int ch_bits)
 {
-	if (v_iter->interleaved)
-		check_buf_block_i(v_iter, runtime);
-	else
-		check_buf_block_ni(v_iter, runtime);
+	return (u32)(frame << ch_bits) | ch;
+}
+
+static void seq_error(struct pcmtst_buf_iter *v_iter, u64 *counter, u64 *first_frame, u64 frame)
+{
+	if (!(*counter)++)
+		*first_frame = frame;
+	mark_corrupted(v_iter, frame);
 }
 
 /*
- * Fill buffer in the non-interleaved mode. The order of samples is C0, ..., C0, C1, ..., C1, C2...
- * The channel buffers lay in the DMA buffer continuously (see default copy_user and copy_kernel
- * handlers in the pcm_lib.c file).
- *
- * Here we increment the DMA buffer position every time we write a byte to any channel 'buffer'.
- * We need this to simulate the correct hardware pointer moving.
+ * Follow the frame counter written by the application. The counter is checked against the
+ * previous frame the application has written (not against our position), so the frames skipped
+ * because the application was late are not reported as gaps. Jumps forward by up to half of the
+ * counter range are gaps, anything else except the repeated previous frame is a reordering.
  */
-static void fill_block_pattern_n(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+static void check_buf_block_seq(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+				size_t bytes)
 {
-	size_t i;
-	unsigned int channels = runtime->channels;
-	short ch_num;
+	struct pcmtst_seq_stats *seq = &v_iter->sub->seq;
+	unsigned int ch, ch_bits = order_base_2(runtime->channels);
+	unsigned int cnt_bits = v_iter->sample_bytes * 8 - ch_bits;
+	u32 ch_mask = (1U << ch_bits) - 1;
+	u32 cnt_mask = cnt_bits >= 32 ? U32_MAX : (1U << cnt_bits) - 1;
+	u64 frame = v_iter->total_bytes / v_iter->frame_bytes;
+	size_t i, frames = bytes / v_iter->frame_bytes;
+	u32 val, cnt, delta;
+
+	for (i = 0; i < frames; i++, frame++) {
+		cnt = (get_sample(sample_ptr(v_iter, runtime, 0), v_iter->sample_bytes) >> ch_bits)
+		      & cnt_mask;
+		// After the skipped frames the sequence continues from whatever comes next
+		if (v_iter->seq_resync) {
+			v_iter->seq_resync = false;
+			seq->next = cnt;
+		}
+		delta = (cnt - seq->next) & cnt_mask;
+		if (!delta) {
+			seq->next = (cnt + 1) & cnt_mask;
+		} else if (delta == cnt_mask) {
+			seq_error(v_iter, &seq->repeats, &seq->first_repeat_frame, frame);
+		} else if (delta <= cnt_mask / 2) {
+			seq->dropped_frames += delta;
+			seq_error(v_iter, &seq->gaps, &seq->first_gap_frame, frame);
+			seq->next = (cnt + 1) & cnt_mask;
+		} else {
+			seq_error(v_iter, &seq->reorders, &seq->first_reorder_frame, frame);
+		}
 
-	for (i = 0; i < v_iter->b_rw; i++) {
-		ch_num = i % channels;
-		runtime->dma_area[buf_pos_n(v_iter, channels, i % channels)] =
-			patt_bufs[ch_num].buf[(v_iter->total_bytes / channels)
-					      % patt_bufs[ch_num].len];
-		inc_buf_pos(v_iter, 1, runtime->dma_bytes);
+		for (ch = 0; ch < runtime->channels; ch++) {
+			val = get_sample(sample_ptr(v_iter, runtime, ch), v_iter->sample_bytes);
+			if ((val & ch_mask) != ch || ((val >> ch_bits) & cnt_mask) != cnt)
+				seq_error(v_iter, &seq->channel_errors,
+					  &seq->first_channel_error_frame, frame);
+		}
+		seq->frames++;
+		inc_buf_pos(v_iter, v_iter->frame_bytes, runtime->dma_bytes);
 	}
 }
 
-// Fill buffer in the interleaved mode. The order of samples is C0, C1, C2, C0, C1, C2, ...
-static void fill_block_pattern_i(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+static void crc_reset(struct pcmtst_buf_iter *v_iter)
 {
-	size_t sample;
-	size_t pos_in_ch, pos_pattern;
-	short ch, pos_sample;
+	memset(v_iter->crc, 0xff, sizeof(v_iter->crc));
+	v_iter->crc_partial = false;
+}
 
-	pos_in_ch = ch_pos_i(v_iter->total_bytes, runtime->channels, v_iter->sample_bytes);
+static void crc_push_period(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			    u64 period)
+{
+	struct pcmtst_crc_rec rec = {
+		.period = period,
+		.flags = v_iter->crc_partial ? CRC_PARTIAL : 0,
+	};
+	unsigned int ch;
 
-	for (sample = 0; sample < v_iter->s_rw_ch; sample++) {
+	if (v_iter->interleaved) {
+		rec.crc = ~v_iter->crc[0];
+		rec.channel = CRC_ALL_CHANNELS;
+		ring_push(&v_iter->sub->crc_ring, &rec);
+	} else {
 		for (ch = 0; ch < runtime->channels; ch++) {
-			for (pos_sample = 0; pos_sample < v_iter->sample_bytes; pos_sample++) {
-				pos_pattern = (pos_in_ch + sample * v_iter->sample_bytes
-					      + pos_sample) % patt_bufs[ch].len;
-				runtime->dma_area[v_iter->buf_pos] = patt_bufs[ch].buf[pos_pattern];
-				inc_buf_pos(v_iter, 1, runtime->dma_bytes);
+			rec.crc = ~v_iter->crc[ch];
+			rec.channel = ch;
+			ring_push(&v_iter->sub->crc_ring, &rec);
+		}
+	}
+	crc_reset(v_iter);
+}
+
+/*
+ * Calculate CRC32C of the next 'bytes' bytes starting 'offset' bytes after the current position,
+ * and push the record every time a period is completed. The data is hashed in the order the
+ * application has written it: the whole frames in the interleaved mode, and every channel
+ * separately in the non-interleaved mode. If 'skip' is set, the bytes weren't committed by the
+ * application, so they are not hashed and the period is marked as partial.
+ */
+static void crc_block(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+		      size_t offset, size_t bytes, bool skip)
+{
+	size_t pos = v_iter->total_bytes + offset, chunk;
+	size_t buf_pos = (v_iter->buf_pos + offset) % runtime->dma_bytes;
+	unsigned int ch, channels = runtime->channels;
+
+	while (bytes) {
+		chunk = min3(bytes, v_iter->period_bytes - pos % v_iter->period_bytes,
+			     runtime->dma_bytes - buf_pos);
+		if (skip) {
+			v_iter->crc_partial = true;
+		} else if (v_iter->interleaved) {
+			v_iter->crc[0] = crc32c(v_iter->crc[0], runtime->dma_area + buf_pos, chunk);
+		} else {
+			for (ch = 0; ch < channels; ch++)
+				v_iter->crc[ch] = crc32c(v_iter->crc[ch], runtime->dma_area +
+							 v_iter->chan_block * ch +
+							 buf_pos / channels, chunk / channels);
+		}
+		pos += chunk;
+		buf_pos = (buf_pos + chunk) % runtime->dma_bytes;
+		bytes -= chunk;
+		if (!(pos % v_iter->period_bytes))
+			crc_push_period(v_iter, runtime, pos / v_iter->period_bytes - 1);
+	}
+}
+
+/*
+ * Copy the next 'bytes' committed bytes to the tap. The data is copied directly from the DMA
+ * buffer into the reserved space of the relay channel. If the reader falls behind, the records
+ * are dropped (and counted) - the tap never stalls the stream.
+ */
+static void tap_block(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime, size_t bytes)
+{
+	size_t pos = v_iter->total_bytes, buf_pos = v_iter->buf_pos, chunk, max_chunk;
+	unsigned int ch, channels = runtime->channels;
+	struct pcmtst_tap_hdr hdr = {
+		.ts_ns = ktime_get_ns(),
+		.channels = channels,
+		.flags = v_iter->interleaved ? 0 : TAP_NONINTERLEAVED,
+	};
+	u8 *dst;
+
+	// Every sub-buffer starts with the padding size, see tap_subbuf_start
+	max_chunk = rounddown(TAP_SUBBUF_SIZE - sizeof(u32) - sizeof(hdr), v_iter->frame_bytes);
+	while (bytes) {
+		chunk = min3(bytes, max_chunk, runtime->dma_bytes - buf_pos);
+		dst = relay_reserve(v_iter->sub->tap_chan, sizeof(hdr) + chunk);
+		if (!dst) {
+			v_iter->sub->tap_dropped += chunk;
+		} else {
+			hdr.frame = pos / v_iter->frame_bytes;
+			hdr.bytes = chunk;
+			memcpy(dst, &hdr, sizeof(hdr));
+			dst += sizeof(hdr);
+			if (v_iter->interleaved) {
+				memcpy(dst, runtime->dma_area + buf_pos, chunk);
+			} else {
+				for (ch = 0; ch < channels; ch++)
+					memcpy(dst + chunk / channels * ch, runtime->dma_area +
+					       v_iter->chan_block * ch + buf_pos / channels,
+					       chunk / channels);
 			}
 		}
+		pos += chunk;
+		buf_pos = (buf_pos + chunk) % runtime->dma_bytes;
+		bytes -= chunk;
 	}
 }
 
-static void fill_block_pattern(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+/*
+ * Decide whether the period is verified. The decision is made once per period, so the verified
+ * periods are always checked completely, even if they are split between several timer ticks.
+ */
+static bool verify_period(struct pcmtst_buf_iter *v_iter, size_t period)
 {
-	if (v_iter->interleaved)
-		fill_block_pattern_i(v_iter, runtime);
+	struct pcmtst_sub *sub = v_iter->sub;
+	u32 every = READ_ONCE(sub->verify_every);
+	u32 percent = READ_ONCE(sub->verify_percent);
+
+	if (period == v_iter->verify_period)
+		return v_iter->verify_cur;
+
+	v_iter->verify_period = period;
+	v_iter->verify_cur = (every <= 1 || !(period % every)) &&
+			     (percent >= 100 || get_random_u32_below(100) < percent);
+	if (v_iter->verify_cur)
+		sub->corruption.checked_periods++;
 	else
-		fill_block_pattern_n(v_iter, runtime);
+		sub->corruption.skipped_periods++;
+	return v_iter->verify_cur;
 }
 
-static void fill_block_rand_n(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+/*
+ * Check the committed bytes period by period, according to the verification policy. The skipped
+ * parts only move the position, all the verified data goes through the same checkers.
+ */
+static void check_periods(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			  size_t bytes)
+{
+	struct pcmtst_corruption *corr = &v_iter->sub->corruption;
+	size_t block;
+
+	for (; bytes; bytes -= block) {
+		block = min(bytes, v_iter->period_bytes -
+				   v_iter->total_bytes % v_iter->period_bytes);
+		if (!verify_period(v_iter, v_iter->total_bytes / v_iter->period_bytes)) {
+			inc_buf_pos(v_iter, block, runtime->dma_bytes);
+			corr->skipped_bytes += block;
+			v_iter->seq_resync = true;
+			continue;
+		}
+
+		if (sub_fill_mode(v_iter->sub) == FILL_MODE_SEQ)
+			check_buf_block_seq(v_iter, runtime, block);
+		else if (v_iter->interleaved)
+			check_buf_block_i(v_iter, runtime, block);
+		else
+			check_buf_block_ni(v_iter, runtime, block);
+		corr->checked_bytes += block;
+	}
+}
+
+/*
+ * Check one block of the buffer. Only the frames which the application has actually committed
+ * (queued between our position and appl_ptr) are checked, so the pattern may contain any bytes
+ * (zeros as well). The rest of the block is the buffer space the application hasn't filled in
+ * time, so we just move the position over it.
+ */
+static void check_buf_block(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			    snd_pcm_uframes_t queued)
+{
+	size_t bytes = min_t(size_t, v_iter->b_rw, frames_to_bytes(runtime, queued));
+
+	if (playback_crc) {
+		crc_block(v_iter, runtime, 0, bytes, false);
+		crc_block(v_iter, runtime, bytes, v_iter->b_rw - bytes, true);
+	}
+	if (v_iter->sub->tap_chan)
+		tap_block(v_iter, runtime, bytes);
+
+	check_periods(v_iter, runtime, bytes);
+	v_iter->sub->corruption.unfilled_bytes += v_iter->b_rw - bytes;
+	inc_buf_pos(v_iter, v_iter->b_rw - bytes, runtime->dma_bytes);
+}
+
+/*
+ * Fill 'len' bytes with the repeated 'unit'. If all bytes of the unit are the same, it is a plain
+ * memset, otherwise the unit is copied once and then the filled part is doubled, so the block
+ * takes O(log(len)) memcpy calls.
+ */
+static void fill_repeat(u8 *dst, size_t len, const u8 *unit, size_t unit_len)
+{
+	size_t done, chunk;
+
+	if (!len)
+		return;
+	if (!memchr_inv(unit, unit[0], unit_len)) {
+		memset(dst, unit[0], len);
+		return;
+	}
+
+	chunk = min(len, unit_len);
+	memcpy(dst, unit, chunk);
+	for (done = chunk; done < len; done += chunk) {
+		chunk = min(done, len - done);
+		memcpy(dst + done, dst, chunk);
+	}
+}
+
+// Write the same frame 'frames' times, the block may wrap around the end of the buffer once
+static void fill_frames_tmpl(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			     const u8 *tmpl, size_t frames)
+{
+	size_t bytes = frames * v_iter->frame_bytes, ch_bytes, pos, first;
+	unsigned int ch;
+	u8 *block;
+
+	if (v_iter->interleaved) {
+		first = min(bytes, runtime->dma_bytes - v_iter->buf_pos);
+		fill_repeat(runtime->dma_area + v_iter->buf_pos, first, tmpl, v_iter->frame_bytes);
+		fill_repeat(runtime->dma_area, bytes - first, tmpl, v_iter->frame_bytes);
+	} else {
+		ch_bytes = frames * v_iter->sample_bytes;
+		pos = v_iter->buf_pos / runtime->channels;
+		first = min(ch_bytes, v_iter->chan_block - pos);
+		for (ch = 0; ch < runtime->channels; ch++) {
+			block = runtime->dma_area + v_iter->chan_block * ch;
+			fill_repeat(block + pos, first, tmpl + ch * v_iter->sample_bytes,
+				    v_iter->sample_bytes);
+			fill_repeat(block, ch_bytes - first, tmpl + ch * v_iter->sample_bytes,
+				    v_iter->sample_bytes);
+		}
+	}
+	inc_buf_pos(v_iter, bytes, runtime->dma_bytes);
+}
+
+/*
+ * If the pattern of every channel is one sample long (or shorter, dividing the sample size),
+ * every frame is the same. Such patterns don't need the byte-by-byte fill.
+ */
+static bool pattern_frame(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			  u8 *tmpl)
+{
+	const struct pattern_buf *patt;
+	unsigned int ch, i;
+
+	for (ch = 0; ch < runtime->channels; ch++) {
+		patt = ch_pattern(v_iter, ch);
+		if (!patt->len || v_iter->sample_bytes % patt->len)
+			return false;
+		for (i = 0; i < v_iter->sample_bytes; i++)
+			tmpl[ch * v_iter->sample_bytes + i] = patt->buf[i % patt->len];
+	}
+	return true;
+}
+
+/*
+ * Fill buffer in the non-interleaved mode. The order of samples is C0, ..., C0, C1, ..., C1, C2...
+ * The channel buffers lay in the DMA buffer continuously (see default copy_user and copy_kernel
+ * handlers in the pcm_lib.c file).
+ *
+ * Here we increment the DMA buffer position every time we write a byte to any channel 'buffer'.
+ * We need this to simulate the correct hardware pointer moving.
+ */
+static void fill_block_pattern_n(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	size_t i;
+	unsigned int channels = runtime->channels;
+	const struct pattern_buf *patts[MAX_CHANNELS_NUM], *patt;
+	short ch_num;
+
+	block_patterns(v_iter, channels, patts);
+	for (i = 0; i < v_iter->b_rw; i++) {
+		ch_num = i % channels;
+		patt = patts[ch_num];
+		runtime->dma_area[buf_pos_n(v_iter, channels, i % channels)] =
+			patt->buf[(gen_pos(v_iter) / channels) % patt->len];
+		inc_buf_pos(v_iter, 1, runtime->dma_bytes);
+	}
+}
+
+// Fill buffer in the interleaved mode. The order of samples is C0, C1, C2, C0, C1, C2, ...
+static void fill_block_pattern_i(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	const struct pattern_buf *patts[MAX_CHANNELS_NUM], *patt;
+	size_t sample;
+	size_t pos_in_ch, pos_pattern;
+	short ch, pos_sample;
+
+	pos_in_ch = ch_pos_i(gen_pos(v_iter), runtime->channels, v_iter->sample_bytes);
+	block_patterns(v_iter, runtime->channels, patts);
+
+	for (sample = 0; sample < v_iter->s_rw_ch; sample++) {
+		for (ch = 0; ch < runtime->channels; ch++) {
+			patt = patts[ch];
+			for (pos_sample = 0; pos_sample < v_iter->sample_bytes; pos_sample++) {
+				pos_pattern = (pos_in_ch + sample * v_iter->sample_bytes
+					      + pos_sample) % patt->len;
+				runtime->dma_area[v_iter->buf_pos] = patt->buf[pos_pattern];
+				inc_buf_pos(v_iter, 1, runtime->dma_bytes);
+			}
+		}
+	}
+}
+
+static void fill_block_pattern(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	u8 tmpl[MAX_FRAME_BYTES];
+
+	if (pattern_frame(v_iter, runtime, tmpl))
+		fill_frames_tmpl(v_iter, runtime, tmpl, v_iter->b_rw / v_iter->frame_bytes);
+	else if (v_iter->interleaved)
+		fill_block_pattern_i(v_iter, runtime);
+	else
+		fill_block_pattern_n(v_iter, runtime);
+}
+
+/*
+ * The constant value is added to the silence of the format, so 0 is silence for both the signed
+ * and the unsigned formats.
+ */
+static void fill_block_const(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	u8 tmpl[MAX_FRAME_BYTES], *sample;
+	unsigned int ch;
+
+	snd_pcm_format_set_silence(runtime->format, tmpl, runtime->channels);
+	for (ch = 0; ch < runtime->channels; ch++) {
+		sample = tmpl + ch * v_iter->sample_bytes;
+		put_sample(sample, v_iter->sample_bytes,
+			   get_sample(sample, v_iter->sample_bytes) + fill_const);
+	}
+	fill_frames_tmpl(v_iter, runtime, tmpl, v_iter->b_rw / v_iter->frame_bytes);
+}
+
+static void fill_block_seq(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	unsigned int ch, ch_bits = order_base_2(runtime->channels);
+	u64 frame = gen_pos(v_iter) / v_iter->frame_bytes;
+	size_t i, frames = v_iter->b_rw / v_iter->frame_bytes;
+
+	for (i = 0; i < frames; i++, frame++) {
+		for (ch = 0; ch < runtime->channels; ch++)
+			put_sample(sample_ptr(v_iter, runtime, ch), v_iter->sample_bytes,
+				   seq_sample(frame, ch, ch_bits));
+		inc_buf_pos(v_iter, v_iter->frame_bytes, runtime->dma_bytes);
+	}
+}
+
+// Copy 'len' bytes from the position 'pos' of the source ring, which may wrap around its end
+static void src_copy(u8 *dst, const u8 *data, u64 pos, size_t len)
+{
+	size_t off = pos & (SRC_DATA_SIZE - 1), chunk = min(len, SRC_DATA_SIZE - off);
+
+	memcpy(dst, data + off, chunk);
+	memcpy(dst + chunk, data, len - chunk);
+}
+
+/*
+ * Copy the frames from the userspace source ring directly into the DMA buffer. The consumed
+ * position is aligned to the frames of the previous streams, which may have another format, so
+ * the samples can cross the end of the ring.
+ */
+static void copy_src_frames(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			    const u8 *data, u64 tail, size_t frames)
+{
+	size_t bytes = frames * v_iter->frame_bytes, chunk, i;
+	const size_t mask = SRC_DATA_SIZE - 1;
+	unsigned int ch;
+
+	if (v_iter->interleaved) {
+		while (bytes) {
+			chunk = min3(bytes, SRC_DATA_SIZE - (size_t)(tail & mask),
+				     runtime->dma_bytes - v_iter->buf_pos);
+			memcpy(runtime->dma_area + v_iter->buf_pos, data + (tail & mask), chunk);
+			inc_buf_pos(v_iter, chunk, runtime->dma_bytes);
+			tail += chunk;
+			bytes -= chunk;
+		}
+	} else {
+		for (i = 0; i < frames; i++) {
+			for (ch = 0; ch < runtime->channels; ch++)
+				src_copy(sample_ptr(v_iter, runtime, ch), data,
+					 tail + ch * v_iter->sample_bytes, v_iter->sample_bytes);
+			inc_buf_pos(v_iter, v_iter->frame_bytes, runtime->dma_bytes);
+			tail += v_iter->frame_bytes;
+		}
+	}
+
+	for (i = 0; i < v_iter->frame_bytes; i++)
+		v_iter->src_last_frame[i] = data[(tail - v_iter->frame_bytes + i) & mask];
+	v_iter->src_last_valid = true;
+}
+
+/*
+ * Move the consumer position of the source ring. The position is kept in the substream and only
+ * published to the control page, which the userspace may overwrite.
+ */
+static void src_consume(struct pcmtst_sub *sub, struct pcmtst_src_ctl *ctl, size_t bytes)
+{
+	// Pairs with source_write reading the tail
+	smp_store_release(&sub->src_tail, sub->src_tail + bytes);
+	smp_store_release(&ctl->tail, sub->src_tail);
+}
+
+/*
+ * Consume the frames written by the userspace into the source ring at the stream rate. If the
+ * ring doesn't contain enough frames, the rest is filled with silence or with the last frame,
+ * depending on the underflow mode.
+ */
+static void fill_block_user(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	struct pcmtst_sub *sub = v_iter->sub;
+	struct pcmtst_src_ctl *ctl = smp_load_acquire(&sub->src);
+	size_t frames = v_iter->b_rw / v_iter->frame_bytes, avail = 0, missing;
+	u8 tmpl[MAX_FRAME_BYTES];
+	u64 head, tail = 0;
+
+	if (ctl) {
+		// The userspace may write anything to the page, so don't trust the head
+		head = smp_load_acquire(&ctl->head);
+		tail = sub->src_tail;
+		avail = min_t(u64, head - tail, SRC_DATA_SIZE) / v_iter->frame_bytes;
+	}
+
+	avail = min(avail, frames);
+	if (avail) {
+		copy_src_frames(v_iter, runtime, (u8 *)ctl + SRC_DATA_OFFSET, tail, avail);
+		src_consume(sub, ctl, avail * v_iter->frame_bytes);
+		v_iter->src_underflow = false;
+	}
+
+	missing = frames - avail;
+	if (!missing)
+		return;
+	if (!v_iter->src_underflow)
+		sub->src_underflows++;
+	v_iter->src_underflow = true;
+	sub->src_underflow_frames += missing;
+	if (ctl)
+		WRITE_ONCE(ctl->underflow_frames, ctl->underflow_frames + missing);
+
+	if (READ_ONCE(sub->src_underflow_mode) == SRC_UNDERFLOW_REPEAT && v_iter->src_last_valid)
+		memcpy(tmpl, v_iter->src_last_frame, v_iter->frame_bytes);
+	else
+		snd_pcm_format_set_silence(runtime->format, tmpl, runtime->channels);
+	fill_frames_tmpl(v_iter, runtime, tmpl, missing);
+}
+
+static void fill_block_rand_n(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
 {
 	unsigned int channels = runtime->channels;
 	// Remaining space in all channel buffers
@@ -298,247 +1554,1767 @@ static void fill_block_rand_n(struct pcmtst_buf_iter *v_iter, struct snd_pcm_run
 	inc_buf_pos(v_iter, v_iter->b_rw, runtime->dma_bytes);
 }
 
-static void fill_block_rand_i(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+static void fill_block_rand_i(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	size_t in_cur_block = runtime->dma_bytes - v_iter->buf_pos;
+
+	if (v_iter->b_rw <= in_cur_block) {
+		get_random_bytes(&runtime->dma_area[v_iter->buf_pos], v_iter->b_rw);
+	} else {
+		get_random_bytes(&runtime->dma_area[v_iter->buf_pos], in_cur_block);
+		get_random_bytes(runtime->dma_area, v_iter->b_rw - in_cur_block);
+	}
+	inc_buf_pos(v_iter, v_iter->b_rw, runtime->dma_bytes);
+}
+
+static void fill_block_random(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	if (v_iter->interleaved)
+		fill_block_rand_i(v_iter, runtime);
+	else
+		fill_block_rand_n(v_iter, runtime);
+}
+
+static void fill_block(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	int mode = sub_fill_mode(v_iter->sub);
+
+	if (v_iter->prerendered) {
+		if (mode == FILL_MODE_PAT && v_iter->prerender_gen == READ_ONCE(patt_gen) &&
+		    v_iter->prerender_bank == v_iter->sub->bank) {
+			inc_buf_pos(v_iter, v_iter->b_rw, runtime->dma_bytes);
+			return;
+		}
+		// From now on the data is written at the current position as usual
+		v_iter->prerendered = false;
+	}
+
+	switch (mode) {
+	case FILL_MODE_RAND:
+		fill_block_random(v_iter, runtime);
+		break;
+	case FILL_MODE_PAT:
+		fill_block_pattern(v_iter, runtime);
+		break;
+	case FILL_MODE_SEQ:
+		fill_block_seq(v_iter, runtime);
+		break;
+	case FILL_MODE_USER:
+		fill_block_user(v_iter, runtime);
+		break;
+	case FILL_MODE_CONST:
+		fill_block_const(v_iter, runtime);
+		break;
+	}
+}
+
+static void inj_log(struct pcmtst_buf_iter *v_iter, u64 frame, u16 type, u16 channel, u32 arg)
+{
+	struct pcmtst_inj_rec rec = {
+		.frame = frame,
+		.arg = arg,
+		.channel = channel,
+		.type = type,
+	};
+
+	ring_push(&v_iter->sub->inj_ring, &rec);
+}
+
+/*
+ * The gaps between the corruptions of one type are uniformly distributed, with the mean of
+ * (scale / rate) frames or bits. The positions depend only on the seed and the settings, not
+ * on the timer ticks.
+ */
+static void inj_schedule(struct pcmtst_buf_iter *v_iter, int type, u64 from)
+{
+	u32 range;
+
+	if (!v_iter->inj_rate[type]) {
+		v_iter->inj_next[type] = U64_MAX;
+		return;
+	}
+	range = div_u64(2ULL * inj_scale[type], v_iter->inj_rate[type]);
+	v_iter->inj_next[type] = from + 1 + prandom_u32_state(&v_iter->inj_rnd) % (range - 1);
+}
+
+// The settings are applied at 'prepare', so the same seed gives the same corruptions
+static void inj_prepare(struct pcmtst_buf_iter *v_iter)
+{
+	struct pcmtst_sub *sub = v_iter->sub;
+	int type;
+
+	prandom_seed_state(&v_iter->inj_rnd, READ_ONCE(sub->inj_seed));
+	v_iter->inj_dc = READ_ONCE(sub->inj_dc);
+	v_iter->inj_active = v_iter->inj_dc;
+	for (type = 0; type < INJ_RANDOM_CNT; type++) {
+		v_iter->inj_rate[type] = min(READ_ONCE(sub->inj_rate[type]), inj_scale[type]);
+		if (v_iter->inj_rate[type])
+			v_iter->inj_active = true;
+		inj_schedule(v_iter, type, 0);
+	}
+	if (v_iter->inj_dc)
+		inj_log(v_iter, 0, INJ_DC, 0, v_iter->inj_dc);
+}
+
+static u64 inj_next_frame(struct pcmtst_buf_iter *v_iter)
+{
+	u64 next = div_u64(v_iter->inj_next[INJ_BIT_FLIP], v_iter->frame_bytes * 8);
+	int type;
+
+	for (type = INJ_DROP; type < INJ_RANDOM_CNT; type++)
+		next = min(next, v_iter->inj_next[type]);
+	return next;
+}
+
+// Fill the frames as usual, adding the DC offset (modulo the sample size, like fill_const)
+static void inj_fill(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+		     size_t frames)
+{
+	unsigned int ch;
+	size_t i, pos;
+	u8 *smp;
+
+	v_iter->s_rw_ch = frames;
+	v_iter->b_rw = frames * v_iter->frame_bytes;
+	fill_block(v_iter, runtime);
+	if (!v_iter->inj_dc)
+		return;
+
+	// If the block is longer than the buffer, its beginning is already overwritten
+	frames = min(frames, runtime->dma_bytes / v_iter->frame_bytes);
+	for (i = frames; i > 0; i--) {
+		pos = prev_frame_pos(v_iter, runtime, i);
+		for (ch = 0; ch < runtime->channels; ch++) {
+			smp = frame_sample_ptr(v_iter, runtime, pos, ch);
+			put_sample(smp, v_iter->sample_bytes,
+				   get_sample(smp, v_iter->sample_bytes) + v_iter->inj_dc);
+		}
+	}
+}
+
+// The userspace source has no generator position, so the dropped frame is skipped in the ring
+static void inj_drop(struct pcmtst_buf_iter *v_iter)
+{
+	struct pcmtst_sub *sub = v_iter->sub;
+	struct pcmtst_src_ctl *ctl;
+
+	v_iter->gen_shift += v_iter->frame_bytes;
+	if (sub_fill_mode(sub) != FILL_MODE_USER)
+		return;
+	ctl = smp_load_acquire(&sub->src);
+	if (ctl && smp_load_acquire(&ctl->head) - sub->src_tail >= v_iter->frame_bytes)
+		src_consume(sub, ctl, v_iter->frame_bytes);
+}
+
+/*
+ * Write the frame which is hit by some corruption. The dropped frame is replaced with the next
+ * one, and the duplicated frame repeats the previous one, so the following frames are shifted
+ * like after a real glitch of the sample clock. The first frame is never duplicated.
+ */
+static void inj_frame(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime, u64 frame)
+{
+	unsigned int ch, other, sample_bits = v_iter->sample_bytes * 8;
+	u8 tmpl[MAX_FRAME_BYTES], tmp[MAX_SAMPLE_BYTES], *smp;
+	u32 bit;
+	size_t pos;
+
+	if (v_iter->inj_next[INJ_DROP] == frame) {
+		inj_drop(v_iter);
+		inj_log(v_iter, frame, INJ_DROP, 0, 0);
+		inj_schedule(v_iter, INJ_DROP, frame);
+	}
+	if (v_iter->inj_next[INJ_DUP] == frame) {
+		pos = prev_frame_pos(v_iter, runtime, 1);
+		for (ch = 0; ch < runtime->channels; ch++)
+			memcpy(tmpl + ch * v_iter->sample_bytes,
+			       frame_sample_ptr(v_iter, runtime, pos, ch), v_iter->sample_bytes);
+		fill_frames_tmpl(v_iter, runtime, tmpl, 1);
+		v_iter->gen_shift -= v_iter->frame_bytes;
+		inj_log(v_iter, frame, INJ_DUP, 0, 0);
+		inj_schedule(v_iter, INJ_DUP, frame);
+	} else {
+		inj_fill(v_iter, runtime, 1);
+	}
+
+	// The frame is written, now it is right behind the current position
+	pos = prev_frame_pos(v_iter, runtime, 1);
+	if (v_iter->inj_next[INJ_SWAP] == frame) {
+		if (runtime->channels > 1) {
+			ch = prandom_u32_state(&v_iter->inj_rnd) % runtime->channels;
+			other = (ch + 1 + prandom_u32_state(&v_iter->inj_rnd) %
+				 (runtime->channels - 1)) % runtime->channels;
+			smp = frame_sample_ptr(v_iter, runtime, pos, ch);
+			memcpy(tmp, smp, v_iter->sample_bytes);
+			memcpy(smp, frame_sample_ptr(v_iter, runtime, pos, other),
+			       v_iter->sample_bytes);
+			memcpy(frame_sample_ptr(v_iter, runtime, pos, other), tmp,
+			       v_iter->sample_bytes);
+			inj_log(v_iter, frame, INJ_SWAP, ch, other);
+		}
+		inj_schedule(v_iter, INJ_SWAP, frame);
+	}
+	while (div_u64_rem(v_iter->inj_next[INJ_BIT_FLIP], v_iter->frame_bytes * 8,
+			   &bit) == frame) {
+		ch = bit / sample_bits;
+		bit %= sample_bits;
+		frame_sample_ptr(v_iter, runtime, pos, ch)[bit / 8] ^= BIT(bit % 8);
+		inj_log(v_iter, frame, INJ_BIT_FLIP, ch, bit);
+		inj_schedule(v_iter, INJ_BIT_FLIP, v_iter->inj_next[INJ_BIT_FLIP]);
+	}
+}
+
+// Fill the capture block, writing the frames which are hit by the corruptions one by one
+static void inj_block(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	size_t b_rw = v_iter->b_rw, s_rw_ch = v_iter->s_rw_ch;
+	u64 frame = v_iter->total_bytes / v_iter->frame_bytes;
+	u64 end = frame + s_rw_ch, at;
+
+	while (frame < end) {
+		at = min(inj_next_frame(v_iter), end);
+		if (at > frame) {
+			inj_fill(v_iter, runtime, at - frame);
+			frame = at;
+		} else {
+			inj_frame(v_iter, runtime, frame++);
+		}
+	}
+	v_iter->b_rw = b_rw;
+	v_iter->s_rw_ch = s_rw_ch;
+}
+
+/*
+ * Distance between the application pointer and our hardware position. For playback it is the
+ * amount of queued frames (how far the application is from an underrun), for capture it is the
+ * amount of unread frames (how far the application is from an overrun). Both pointers start
+ * from zero after the 'prepare' callback, so our position is exactly total_bytes.
+ */
+static snd_pcm_uframes_t appl_margin(struct pcmtst_buf_iter *v_iter,
+				     struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	snd_pcm_uframes_t hw_ptr = bytes_to_frames(runtime, v_iter->total_bytes) %
+				   runtime->boundary;
+	snd_pcm_uframes_t appl_ptr = READ_ONCE(runtime->control->appl_ptr);
+	snd_pcm_sframes_t margin;
+
+	// Pairs with the application writing the data before moving appl_ptr
+	smp_rmb();
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK)
+		margin = appl_ptr - hw_ptr;
+	else
+		margin = hw_ptr - appl_ptr;
+	if (margin < 0)
+		margin += runtime->boundary;
+	// The application has already lost the race, the xrun will be reported by the core
+	if (margin > runtime->buffer_size)
+		margin = 0;
+	return margin;
+}
+
+static void stats_publish(struct pcmtst_buf_iter *v_iter, u8 state)
+{
+	struct pcmtst_sub *sub = v_iter->sub;
+	struct pcmtst_stats_rec *rec = sub->stats_rec;
+	struct snd_pcm_runtime *runtime = v_iter->substream->runtime;
+
+	WRITE_ONCE(rec->seq, rec->seq + 1);
+	smp_wmb();
+
+	rec->state = state;
+	rec->buf_corrupted = v_iter->is_buf_corrupted;
+	rec->ticks = sub->ticks;
+	rec->total_bytes = v_iter->total_bytes;
+	if (runtime->frame_bits)
+		rec->hw_ptr = bytes_to_frames(runtime, v_iter->total_bytes);
+	rec->appl_ptr = READ_ONCE(runtime->control->appl_ptr);
+	rec->periods = sub->periods;
+	rec->pointer_calls = sub->pointer_calls;
+	rec->ack_calls = sub->ack_calls;
+	rec->headroom = sub->headroom;
+	rec->wakeup_lat = sub->wakeup_lat;
+	rec->first_mismatch_frame = sub->corruption.first_frame;
+	rec->mismatch_bytes = sub->corruption.mismatch_bytes;
+	rec->corrupt_periods = sub->corruption.corrupt_periods;
+
+	smp_wmb();
+	WRITE_ONCE(rec->seq, rec->seq + 1);
+}
+
+/*
+ * Most xruns are detected by the core during our snd_pcm_period_elapsed call, the rest - when
+ * the application queries the pointer. The latter ones are reported on the next timer tick.
+ */
+static void check_xrun(struct pcmtst_buf_iter *v_iter, struct snd_pcm_substream *substream)
+{
+	if (READ_ONCE(substream->runtime->state) != SNDRV_PCM_STATE_XRUN || v_iter->xrun_reported)
+		return;
+	v_iter->xrun_reported = true;
+	emit_event(substream, EVENT_XRUN, 0);
+}
+
+// We want to record RATE * ch_cnt samples per sec, scaled by the substream rate scale
+static size_t tick_frames(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	u64 frames;
+
+	v_iter->rate_frac += (u64)runtime->rate * v_iter->rate_scale *
+			     v_iter->interval;
+	frames = div_u64(v_iter->rate_frac, HZ * 100);
+	v_iter->rate_frac -= frames * HZ * 100;
+	// The fill and check helpers can wrap around the buffer only once
+	return min_t(u64, frames, runtime->buffer_size);
+}
+
+/*
+ * Count the frames of the trace samples which are due by now, and find the time of the next
+ * sample. The first sample of the trace is aligned to the moment when the stream starts running.
+ * When the trace ends, it is looped: the first sample of the next loop coincides with the last
+ * sample. The timestamps are strictly increasing, so every loop takes some time.
+ */
+static size_t trace_frames(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime,
+			   ktime_t *next)
+{
+	const struct pcmtst_trace_smp *smp = v_iter->sub->trace;
+	unsigned int len = v_iter->sub->trace_len;
+	ktime_t now = ktime_get();
+	u64 frames = 0;
+	s64 now_us;
+
+	if (!v_iter->trace_started) {
+		v_iter->trace_started = true;
+		v_iter->trace_base = now;
+		v_iter->trace_idx = 1;
+	}
+
+	now_us = ktime_us_delta(now, v_iter->trace_base);
+	while (smp[v_iter->trace_idx].usec - smp[0].usec <= now_us) {
+		frames += smp[v_iter->trace_idx].frame - smp[v_iter->trace_idx - 1].frame;
+		if (++v_iter->trace_idx == len) {
+			v_iter->trace_base = ktime_add_us(v_iter->trace_base,
+							  smp[len - 1].usec - smp[0].usec);
+			now_us = ktime_us_delta(now, v_iter->trace_base);
+			v_iter->trace_idx = 1;
+		}
+	}
+
+	*next = ktime_add_us(v_iter->trace_base, smp[v_iter->trace_idx].usec - smp[0].usec);
+	return min_t(u64, frames, runtime->buffer_size);
+}
+
+static void set_bank(struct pcmtst_buf_iter *v_iter, struct snd_pcm_substream *substream,
+		     u32 bank)
+{
+	struct pcmtst_sub *sub = v_iter->sub;
+
+	sub->bank = bank;
+	sub->bank_switch_frame = v_iter->total_bytes / v_iter->frame_bytes;
+	sub->bank_switches++;
+	emit_event(substream, EVENT_BANK, bank);
+}
+
+/*
+ * Execute the scenario actions which are due at the current position. Returns the count of
+ * frames (up to 'frames') which can be processed before the next action, or 0 if the rest of
+ * the tick must be skipped.
+ */
+static size_t run_scenario(struct pcmtst_buf_iter *v_iter, struct snd_pcm_substream *substream,
+			   size_t frames)
+{
+	struct pcmtst_sub *sub = v_iter->sub;
+	u64 pos = v_iter->total_bytes / v_iter->frame_bytes;
+	const struct pcmtst_scn_action *act;
+
+	while (v_iter->scn_pos < sub->scenario_len) {
+		act = &sub->scenario[v_iter->scn_pos];
+		if (act->frame > pos)
+			return min_t(u64, frames, act->frame - pos);
+
+		emit_event(substream, EVENT_SCENARIO, v_iter->scn_pos);
+		v_iter->scn_pos++;
+		switch (act->action) {
+		case SCN_XRUN:
+			snd_pcm_stop_xrun(substream);
+			check_xrun(v_iter, substream);
+			return 0;
+		case SCN_STALL:
+			v_iter->stall_ticks = act->arg;
+			if (act->arg)
+				return 0;
+			break;
+		case SCN_RATE:
+			v_iter->rate_scale = act->arg;
+			break;
+		case SCN_FAIL_TRIGGER:
+			v_iter->fail_trigger = true;
+			break;
+		case SCN_BANK:
+			set_bank(v_iter, substream, act->arg);
+			break;
+		}
+	}
+	return frames;
+}
+
+/*
+ * Apply the pending bank switch if it is due, or end the block right before the switch frame.
+ * The fill and the check read the bank once per block, so they change it exactly at this frame.
+ */
+static size_t bank_switch(struct pcmtst_buf_iter *v_iter, struct snd_pcm_substream *substream,
+			  size_t frames)
+{
+	struct pcmtst_sub *sub = v_iter->sub;
+	u64 pos = v_iter->total_bytes / v_iter->frame_bytes;
+	u64 req = READ_ONCE(sub->bank_req);
+	u64 at = req >> BANK_REQ_BITS;
+
+	if (req == BANK_REQ_NONE)
+		return frames;
+	if (at > pos)
+		return min_t(u64, frames, at - pos);
+	// A new request may come meanwhile, it must not be lost
+	if (cmpxchg64(&sub->bank_req, req, BANK_REQ_NONE) == req)
+		set_bank(v_iter, substream, req & GENMASK_ULL(BANK_REQ_BITS - 1, 0));
+	return frames;
+}
+
+// Move the hardware pointer by 'frames', which may be a part of the tick
+static void advance(struct pcmtst_buf_iter *v_iter, struct snd_pcm_substream *substream,
+		    size_t frames)
+{
+	bool was_corrupted;
+
+	v_iter->s_rw_ch = frames;
+	v_iter->b_rw = frames * v_iter->frame_bytes;
+
+	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		was_corrupted = v_iter->is_buf_corrupted;
+		check_buf_block(v_iter, substream->runtime, appl_margin(v_iter, substream));
+		if (!was_corrupted && v_iter->is_buf_corrupted)
+			emit_event(substream, EVENT_CORRUPTION, v_iter->first_error_frame);
+	} else if (v_iter->inj_active) {
+		inj_block(v_iter, substream->runtime);
+	} else {
+		fill_block(v_iter, substream->runtime);
+	}
+
+	v_iter->period_pos += v_iter->b_rw;
+	if (v_iter->period_pos >= v_iter->period_bytes) {
+		v_iter->period_pos %= v_iter->period_bytes;
+		v_iter->period_ts = ktime_get();
+		// Pairs with the 'ack' callback, which runs without the timer synchronization
+		smp_store_release(&v_iter->ack_pending, true);
+		v_iter->sub->periods++;
+		emit_event(substream, EVENT_PERIOD, v_iter->sub->periods - 1);
+		snd_pcm_period_elapsed(substream);
+		check_xrun(v_iter, substream);
+	}
+}
+
+/*
+ * Here we iterate through the buffer by (buffer_size / iterates_per_second) bytes.
+ * The driver uses timer to simulate the hardware pointer moving, and notify the PCM middle layer
+ * about period elapsed. The tick is split into several blocks if the scenario has actions
+ * inside of it, so the actions are executed at the exact frame positions.
+ */
+static void timer_timeout(struct timer_list *data)
+{
+	struct pcmtst_buf_iter *v_iter;
+	struct snd_pcm_substream *substream;
+	unsigned long interval;
+	size_t frames, block;
+	ktime_t next;
+
+	v_iter = from_timer(v_iter, data, timer_instance);
+	substream = v_iter->substream;
+
+	v_iter->sub->ticks++;
+	interval = v_iter->interval;
+
+	// The hardware pointer moves only when the stream is running
+	if (!snd_pcm_running(substream)) {
+		v_iter->trace_started = false;
+		check_xrun(v_iter, substream);
+		stats_publish(v_iter, SUB_STATE_OPEN);
+		goto rearm;
+	}
+
+	if (v_iter->stall_ticks) {
+		v_iter->stall_ticks--;
+		stats_publish(v_iter, SUB_STATE_RUNNING);
+		goto rearm;
+	}
+
+	/*
+	 * The trace replay wakes up at the time of the next sample, so the pointer position follows
+	 * the trace with the jiffy precision.
+	 */
+	if (v_iter->sub->trace_len >= TRACE_MIN_SAMPLES) {
+		frames = trace_frames(v_iter, substream->runtime, &next);
+		interval = max(usecs_to_jiffies(max_t(s64, ktime_us_delta(next, ktime_get()), 0)),
+			       1UL);
+	} else {
+		frames = tick_frames(v_iter, substream->runtime);
+	}
+	while (frames && snd_pcm_running(substream)) {
+		block = run_scenario(v_iter, substream, frames);
+		if (!block)
+			break;
+		block = bank_switch(v_iter, substream, block);
+		advance(v_iter, substream, block);
+		frames -= block;
+	}
+	hist_add(&v_iter->sub->headroom, appl_margin(v_iter, substream));
+	stats_publish(v_iter, SUB_STATE_RUNNING);
+rearm:
+	mod_timer(&v_iter->timer_instance,
+		  jiffies + interval + sub_param(&v_iter->sub->ovr.inject_delay, inject_delay));
+}
+
+static int snd_pcmtst_pcm_open(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct pcmtst_dev *dev = substream->pcm->private_data;
+	struct pcmtst_buf_iter *v_iter;
+
+	v_iter = kzalloc(sizeof(*v_iter), GFP_KERNEL);
+	if (!v_iter)
+		return -ENOMEM;
+
+	runtime->hw = dev->profile->hw;
+	runtime->private_data = v_iter;
+	v_iter->substream = substream;
+	v_iter->sub = get_pcmtst_sub(substream);
+	v_iter->interval = max(msecs_to_jiffies(dev->profile->tick_ms), 1UL);
+	mutex_lock(&v_iter->sub->lock);
+	v_iter->sub->opened = true;
+	v_iter->start_bank = v_iter->sub->bank;
+	mutex_unlock(&v_iter->sub->lock);
+	v_iter->buf_pos = 0;
+	v_iter->is_buf_corrupted = false;
+	v_iter->period_pos = 0;
+	v_iter->total_bytes = 0;
+
+	playback_capture_test = 0;
+	ioctl_reset_test = 0;
+	reset_sub_stats(v_iter->sub);
+	stats_publish(v_iter, SUB_STATE_OPEN);
+
+	timer_setup(&v_iter->timer_instance, timer_timeout, 0);
+	mod_timer(&v_iter->timer_instance, jiffies + v_iter->interval);
+	return 0;
+}
+
+static int snd_pcmtst_pcm_close(struct snd_pcm_substream *substream)
+{
+	struct pcmtst_buf_iter *v_iter = substream->runtime->private_data;
+
+	timer_shutdown_sync(&v_iter->timer_instance);
+	stats_publish(v_iter, SUB_STATE_CLOSED);
+	mutex_lock(&v_iter->sub->lock);
+	// Make the partially filled sub-buffer available to the reader
+	if (v_iter->sub->tap_chan)
+		relay_flush(v_iter->sub->tap_chan);
+	v_iter->sub->opened = false;
+	// The bank changes and requests of this stream don't leak into the next one
+	v_iter->sub->bank = v_iter->start_bank;
+	v_iter->sub->bank_req = BANK_REQ_NONE;
+	mutex_unlock(&v_iter->sub->lock);
+	v_iter->substream = NULL;
+	playback_capture_test = !v_iter->is_buf_corrupted;
+	kfree(v_iter);
+	return 0;
+}
+
+static int snd_pcmtst_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct pcmtst_buf_iter *v_iter = runtime->private_data;
+
+	if (sub_param(&v_iter->sub->ovr.inject_trigger_err, inject_trigger_err) ||
+	    v_iter->fail_trigger) {
+		v_iter->fail_trigger = false;
+		emit_event(substream, EVENT_FAULT, FAULT_TRIGGER);
+		return -EINVAL;
+	}
+	// The period elapsed before the stop isn't answered by the next appl_ptr update
+	if (cmd == SNDRV_PCM_TRIGGER_STOP)
+		WRITE_ONCE(v_iter->ack_pending, false);
+	emit_event(substream, EVENT_TRIGGER, cmd);
+	return 0;
+}
+
+static snd_pcm_uframes_t snd_pcmtst_pcm_pointer(struct snd_pcm_substream *substream)
+{
+	struct pcmtst_buf_iter *v_iter = substream->runtime->private_data;
+
+	v_iter->sub->pointer_calls++;
+	return bytes_to_frames(substream->runtime, v_iter->buf_pos);
+}
+
+/*
+ * The 'ack' callback is called every time the application moves appl_ptr. The first call after
+ * the period elapsed event shows how long the application needed to wake up and respond. The
+ * SNDRV_PCM_INFO_SYNC_APPLPTR flag makes mmap clients report appl_ptr through the SYNC_PTR
+ * ioctl, so they are covered as well.
+ */
+static int snd_pcmtst_pcm_ack(struct snd_pcm_substream *substream)
+{
+	struct pcmtst_buf_iter *v_iter = substream->runtime->private_data;
+	s64 delta;
+
+	v_iter->sub->ack_calls++;
+	if (!smp_load_acquire(&v_iter->ack_pending))
+		return 0;
+	WRITE_ONCE(v_iter->ack_pending, false);
+	delta = ktime_us_delta(ktime_get(), v_iter->period_ts);
+	hist_add(&v_iter->sub->wakeup_lat, max_t(s64, delta, 0));
+	return 0;
+}
+
+static void snd_pcmtst_dev_cleanup(struct pcmtst_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < PLAYBACK_SUBSTREAM_CNT; i++) {
+		ring_close(&dev->playback_subs[i].crc_ring);
+		// The relay channel removes its own files, so close it before the directory
+		if (dev->playback_subs[i].tap_chan)
+			relay_close(dev->playback_subs[i].tap_chan);
+	}
+	for (i = 0; i < CAPTURE_SUBSTREAM_CNT; i++)
+		ring_close(&dev->capture_subs[i].inj_ring);
+	debugfs_remove_recursive(dev->debug_dirs[SNDRV_PCM_STREAM_PLAYBACK]);
+	debugfs_remove_recursive(dev->debug_dirs[SNDRV_PCM_STREAM_CAPTURE]);
+	for (i = 0; i < PLAYBACK_SUBSTREAM_CNT; i++) {
+		ring_free(&dev->playback_subs[i].crc_ring);
+		mutex_destroy(&dev->playback_subs[i].lock);
+		vfree(dev->playback_subs[i].trace);
+	}
+	for (i = 0; i < CAPTURE_SUBSTREAM_CNT; i++) {
+		ring_free(&dev->capture_subs[i].inj_ring);
+		mutex_destroy(&dev->capture_subs[i].lock);
+		vfree(dev->capture_subs[i].trace);
+		// Like the statistics page, the mapped pages are refcounted
+		vfree(dev->capture_subs[i].src);
+	}
+}
+
+static int snd_pcmtst_free(struct pcmtst *pcmtst)
+{
+	int i;
+
+	if (!pcmtst)
+		return 0;
+	for (i = 0; i < pcmtst->dev_cnt; i++)
+		snd_pcmtst_dev_cleanup(&pcmtst->devs[i]);
+	debugfs_remove(pcmtst->stats_file);
+	ring_close(&pcmtst->events);
+	debugfs_remove(pcmtst->events_file);
+	debugfs_lookup_and_remove("events_dropped", driver_debug_dir);
+	ring_free(&pcmtst->events);
+	// The pages which are still mapped to the userspace are refcounted, so it is safe
+	vfree(pcmtst->stats);
+	kvfree(pcmtst);
+	return 0;
+}
+
+/*
+ * The card is freed only after all of its substreams are closed, so the per-substream state
+ * can't be freed earlier than here.
+ */
+static int snd_pcmtst_dev_free(struct snd_device *device)
+{
+	return snd_pcmtst_free(device->device_data);
+}
+
+// This callback is required, but empty - all freeing occurs in snd_pcmtst_dev_free
+static void pcmtst_pdev_release(struct device *dev)
+{
+}
+
+/*
+ * If the length of every channel buffer is a multiple of the channel pattern, every wrap of the
+ * capture buffer writes the same bytes again. In this case the whole buffer is rendered once,
+ * and the timer only moves the pointer until the fill mode or the patterns are changed.
+ */
+static void prerender(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+{
+	size_t ch_bytes = runtime->buffer_size * v_iter->sample_bytes;
+	unsigned int ch, len;
+
+	v_iter->prerendered = false;
+	// The corruptions are written into the buffer, so they would be repeated on every wrap
+	if (sub_fill_mode(v_iter->sub) != FILL_MODE_PAT || v_iter->inj_active)
+		return;
+	for (ch = 0; ch < runtime->channels; ch++) {
+		len = ch_pattern(v_iter, ch)->len;
+		if (!len || ch_bytes % len)
+			return;
+	}
+
+	// The patterns may change while rendering, then the buffer will be filled as usual
+	v_iter->prerender_gen = READ_ONCE(patt_gen);
+	smp_rmb();
+	v_iter->prerender_bank = v_iter->sub->bank;
+	v_iter->s_rw_ch = runtime->buffer_size;
+	v_iter->b_rw = frames_to_bytes(runtime, runtime->buffer_size);
+	fill_block_pattern(v_iter, runtime);
+	v_iter->buf_pos = 0;
+	v_iter->total_bytes = 0;
+	v_iter->prerendered = true;
+}
+
+static int snd_pcmtst_pcm_prepare(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct pcmtst_buf_iter *v_iter = runtime->private_data;
+
+	if (sub_param(&v_iter->sub->ovr.inject_prepare_err, inject_prepare_err)) {
+		emit_event(substream, EVENT_FAULT, FAULT_PREPARE);
+		return -EINVAL;
+	}
+
+	// Both hw_ptr and appl_ptr start from zero after the stream is prepared
+	v_iter->buf_pos = 0;
+	v_iter->period_pos = 0;
+	v_iter->total_bytes = 0;
+	v_iter->xrun_reported = false;
+	WRITE_ONCE(v_iter->ack_pending, false);
+	// The scenario positions are counted from here as well
+	v_iter->rate_frac = 0;
+	v_iter->rate_scale = READ_ONCE(v_iter->sub->rate_scale);
+	v_iter->scn_pos = 0;
+	v_iter->stall_ticks = 0;
+	v_iter->trace_started = false;
+	v_iter->verify_period = SIZE_MAX;
+	v_iter->seq_resync = false;
+	v_iter->gen_shift = 0;
+	// Every run of the scenario starts from the same bank
+	WRITE_ONCE(v_iter->sub->bank, v_iter->start_bank);
+	// The application is expected to start its sequence from zero as well
+	v_iter->sub->seq.next = 0;
+	crc_reset(v_iter);
+
+	v_iter->sample_bytes = runtime->sample_bits / 8;
+	v_iter->frame_bytes = v_iter->sample_bytes * runtime->channels;
+	v_iter->period_bytes = frames_to_bytes(runtime, runtime->period_size);
+	if (runtime->access == SNDRV_PCM_ACCESS_RW_NONINTERLEAVED ||
+	    runtime->access == SNDRV_PCM_ACCESS_MMAP_NONINTERLEAVED) {
+		v_iter->chan_block = runtime->dma_bytes / runtime->channels;
+		v_iter->interleaved = false;
+	} else {
+		v_iter->interleaved = true;
+	}
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		inj_prepare(v_iter);
+		prerender(v_iter, runtime);
+	}
+	return 0;
+}
+
+static int snd_pcmtst_pcm_hw_params(struct snd_pcm_substream *substream,
+				    struct snd_pcm_hw_params *params)
+{
+	struct pcmtst_sub *sub = get_pcmtst_sub(substream);
+
+	if (sub_param(&sub->ovr.inject_hwpars_err, inject_hwpars_err)) {
+		emit_event(substream, EVENT_FAULT, FAULT_HW_PARAMS);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+static int snd_pcmtst_pcm_hw_free(struct snd_pcm_substream *substream)
+{
+	return 0;
+}
+
+static int snd_pcmtst_ioctl(struct snd_pcm_substream *substream, unsigned int cmd, void *arg)
+{
+	struct pcmtst_sub *sub = get_pcmtst_sub(substream);
+	struct pcmtst_ioctl_stat *stat = &sub->ioctls[min_t(unsigned int, cmd, IOCTL1_CMD_CNT)];
+	u64 start, elapsed;
+	int err;
+
+	switch (cmd) {
+	case SNDRV_PCM_IOCTL1_RESET:
+		ioctl_reset_test = 1;
+		break;
+	}
+
+	start = ktime_get_ns();
+	err = snd_pcm_lib_ioctl(substream, cmd, arg);
+	elapsed = ktime_get_ns() - start;
+
+	stat->calls++;
+	stat->total_ns += elapsed;
+	if (elapsed > stat->max_ns)
+		stat->max_ns = elapsed;
+	return err;
+}
+
+static const struct snd_pcm_ops snd_pcmtst_playback_ops = {
+	.open =		snd_pcmtst_pcm_open,
+	.close =	snd_pcmtst_pcm_close,
+	.trigger =	snd_pcmtst_pcm_trigger,
+	.hw_params =	snd_pcmtst_pcm_hw_params,
+	.ioctl =	snd_pcmtst_ioctl,
+	.hw_free =	snd_pcmtst_pcm_hw_free,
+	.prepare =	snd_pcmtst_pcm_prepare,
+	.pointer =	snd_pcmtst_pcm_pointer,
+	.ack =		snd_pcmtst_pcm_ack,
+};
+
+static const struct snd_pcm_ops snd_pcmtst_capture_ops = {
+	.open =		snd_pcmtst_pcm_open,
+	.close =	snd_pcmtst_pcm_close,
+	.trigger =	snd_pcmtst_pcm_trigger,
+	.hw_params =	snd_pcmtst_pcm_hw_params,
+	.hw_free =	snd_pcmtst_pcm_hw_free,
+	.ioctl =	snd_pcmtst_ioctl,
+	.prepare =	snd_pcmtst_pcm_prepare,
+	.pointer =	snd_pcmtst_pcm_pointer,
+	.ack =		snd_pcmtst_pcm_ack,
+};
+
+static int snd_pcmtst_new_pcm(struct pcmtst *pcmtst, int device)
+{
+	struct pcmtst_dev *dev = &pcmtst->devs[device];
+	struct snd_pcm *pcm;
+	int err;
+
+	err = snd_pcm_new(pcmtst->card, "PCMTest", device, PLAYBACK_SUBSTREAM_CNT,
+			  CAPTURE_SUBSTREAM_CNT, &pcm);
+	if (err < 0)
+		return err;
+	pcm->private_data = dev;
+	snprintf(pcm->name, sizeof(pcm->name), "PCMTest %s", dev->profile->name);
+	dev->pcm = pcm;
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &snd_pcmtst_playback_ops);
+	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_pcmtst_capture_ops);
+
+	err = snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_DEV, &pcmtst->pdev->dev,
+					     0, dev->profile->hw.buffer_bytes_max);
+	return err;
+}
+
+static int headroom_show(struct seq_file *s, void *data)
+{
+	struct pcmtst_sub *sub = s->private;
+
+	hist_show(s, &sub->headroom, "frames");
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(headroom);
+
+static int wakeup_latency_show(struct seq_file *s, void *data)
+{
+	struct pcmtst_sub *sub = s->private;
+
+	hist_show(s, &sub->wakeup_lat, "us");
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(wakeup_latency);
+
+static const char * const ioctl1_names[IOCTL1_CMD_CNT + 1] = {
+	[SNDRV_PCM_IOCTL1_RESET] = "RESET",
+	[SNDRV_PCM_IOCTL1_INFO] = "INFO",
+	[SNDRV_PCM_IOCTL1_CHANNEL_INFO] = "CHANNEL_INFO",
+	[SNDRV_PCM_IOCTL1_FIFO_SIZE] = "FIFO_SIZE",
+#ifdef SNDRV_PCM_IOCTL1_SYNC_ID
+	[SNDRV_PCM_IOCTL1_SYNC_ID] = "SYNC_ID",
+#endif
+	[IOCTL1_CMD_CNT] = "other",
+};
+
+static int ioctl_stats_show(struct seq_file *s, void *data)
+{
+	struct pcmtst_sub *sub = s->private;
+	const struct pcmtst_ioctl_stat *stat;
+	unsigned int i;
+
+	seq_printf(s, "%-14s %12s %14s %10s\n", "ioctl", "calls", "total_ns", "max_ns");
+	for (i = 0; i <= IOCTL1_CMD_CNT; i++) {
+		stat = &sub->ioctls[i];
+		if (!stat->calls)
+			continue;
+		if (ioctl1_names[i])
+			seq_printf(s, "%-14s", ioctl1_names[i]);
+		else
+			seq_printf(s, "cmd%-11u", i);
+		seq_printf(s, " %12llu %14llu %10llu\n", stat->calls, stat->total_ns, stat->max_ns);
+	}
+	seq_printf(s, "pointer calls: %llu\n", sub->pointer_calls);
+	seq_printf(s, "ack calls: %llu\n", sub->ack_calls);
+	seq_printf(s, "periods: %llu\n", sub->periods);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ioctl_stats);
+
+static int corruption_show(struct seq_file *s, void *data)
+{
+	struct pcmtst_sub *sub = s->private;
+	const struct pcmtst_corruption *corr = &sub->corruption;
+
+	seq_printf(s, "corrupted: %d\n", !!corr->mismatch_bytes);
+	seq_printf(s, "mismatched bytes: %llu\n", corr->mismatch_bytes);
+	seq_printf(s, "corrupted periods: %llu\n", corr->corrupt_periods);
+	seq_printf(s, "checked bytes: %llu\n", corr->checked_bytes);
+	seq_printf(s, "unfilled bytes: %llu\n", corr->unfilled_bytes);
+	seq_printf(s, "skipped bytes: %llu\n", corr->skipped_bytes);
+	seq_printf(s, "checked periods: %llu\n", corr->checked_periods);
+	seq_printf(s, "skipped periods: %llu\n", corr->skipped_periods);
+	if (corr->checked_bytes + corr->skipped_bytes)
+		seq_printf(s, "coverage: %llu%%\n",
+			   div64_u64(corr->checked_bytes * 100,
+				     corr->checked_bytes + corr->skipped_bytes));
+	if (!corr->mismatch_bytes)
+		return 0;
+	seq_printf(s, "first frame: %llu\n", corr->first_frame);
+	seq_printf(s, "first channel: %u\n", corr->first_channel);
+	seq_printf(s, "expected: 0x%02x\n", corr->expected);
+	seq_printf(s, "actual: 0x%02x\n", corr->actual);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(corruption);
+
+static int sequence_show(struct seq_file *s, void *data)
+{
+	struct pcmtst_sub *sub = s->private;
+	const struct pcmtst_seq_stats *seq = &sub->seq;
+
+	seq_printf(s, "checked frames: %llu\n", seq->frames);
+	seq_printf(s, "gaps: %llu\n", seq->gaps);
+	seq_printf(s, "dropped frames: %llu\n", seq->dropped_frames);
+	seq_printf(s, "repeats: %llu\n", seq->repeats);
+	seq_printf(s, "reorders: %llu\n", seq->reorders);
+	seq_printf(s, "channel errors: %llu\n", seq->channel_errors);
+	if (seq->gaps)
+		seq_printf(s, "first gap frame: %llu\n", seq->first_gap_frame);
+	if (seq->repeats)
+		seq_printf(s, "first repeat frame: %llu\n", seq->first_repeat_frame);
+	if (seq->reorders)
+		seq_printf(s, "first reorder frame: %llu\n", seq->first_reorder_frame);
+	if (seq->channel_errors)
+		seq_printf(s, "first channel error frame: %llu\n",
+			   seq->first_channel_error_frame);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(sequence);
+
+static ssize_t stats_read(struct file *file, char __user *u_buff, size_t len, loff_t *off)
+{
+	struct pcmtst *pcmtst = file->private_data;
+	ssize_t res;
+
+	res = debugfs_file_get(file->f_path.dentry);
+	if (res)
+		return res;
+	res = simple_read_from_buffer(u_buff, len, off, pcmtst->stats, pcmtst->stats_size);
+	debugfs_file_put(file->f_path.dentry);
+	return res;
+}
+
+static int stats_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pcmtst *pcmtst = file->private_data;
+	int err;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	err = debugfs_file_get(file->f_path.dentry);
+	if (err)
+		return err;
+	err = remap_vmalloc_range(vma, pcmtst->stats, vma->vm_pgoff);
+	debugfs_file_put(file->f_path.dentry);
+	return err;
+}
+
+// debugfs proxy doesn't support mmap, so the file is created 'unsafe' and protects itself
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = stats_read,
+	.mmap = stats_mmap,
+	.llseek = default_llseek,
+};
+
+static int init_stats_page(struct pcmtst *pcmtst)
+{
+	struct pcmtst_stats_rec *recs;
+	struct pcmtst_dev *dev;
+	int i, d, cnt = (PLAYBACK_SUBSTREAM_CNT + CAPTURE_SUBSTREAM_CNT) * pcmtst->dev_cnt;
+
+	pcmtst->stats_size = PAGE_ALIGN(sizeof(*pcmtst->stats) + cnt * sizeof(*recs));
+	pcmtst->stats = vmalloc_user(pcmtst->stats_size);
+	if (!pcmtst->stats)
+		return -ENOMEM;
+
+	pcmtst->stats->magic = STATS_MAGIC;
+	pcmtst->stats->version = STATS_VERSION;
+	pcmtst->stats->hdr_size = sizeof(*pcmtst->stats);
+	pcmtst->stats->rec_size = sizeof(*recs);
+	pcmtst->stats->rec_count = cnt;
+
+	recs = (struct pcmtst_stats_rec *)(pcmtst->stats + 1);
+	for (d = 0; d < pcmtst->dev_cnt; d++) {
+		dev = &pcmtst->devs[d];
+		for (i = 0; i < PLAYBACK_SUBSTREAM_CNT; i++) {
+			recs[i].stream = SNDRV_PCM_STREAM_PLAYBACK;
+			recs[i].number = i;
+			recs[i].device = d;
+			dev->playback_subs[i].stats_rec = &recs[i];
+		}
+		recs += PLAYBACK_SUBSTREAM_CNT;
+		for (i = 0; i < CAPTURE_SUBSTREAM_CNT; i++) {
+			recs[i].stream = SNDRV_PCM_STREAM_CAPTURE;
+			recs[i].number = i;
+			recs[i].device = d;
+			dev->capture_subs[i].stats_rec = &recs[i];
+		}
+		recs += CAPTURE_SUBSTREAM_CNT;
+	}
+
+	pcmtst->stats_file = debugfs_create_file_unsafe("stats", 0444, driver_debug_dir, pcmtst,
+							&stats_fops);
+	return 0;
+}
+
+/*
+ * Every sub-buffer of the tap starts with the u32 size of the padding at its end, which is
+ * filled when the sub-buffer is finished (see Documentation/filesystems/relay.rst).
+ */
+static int tap_subbuf_start(struct rchan_buf *buf, void *subbuf, void *prev_subbuf,
+			    size_t prev_padding)
+{
+	if (prev_subbuf)
+		*(u32 *)prev_subbuf = prev_padding;
+	// Never overwrite the data the reader hasn't consumed yet
+	if (relay_buf_full(buf))
+		return 0;
+	subbuf_start_reserve(buf, sizeof(u32));
+	return 1;
+}
+
+// The debugfs proxy doesn't support mmap, and the relay channel refcounts its buffers itself
+static struct dentry *tap_create_buf_file(const char *filename, struct dentry *parent,
+					  umode_t mode, struct rchan_buf *buf, int *is_global)
+{
+	// The tap is written by one timer at a time, so a single buffer is enough
+	*is_global = 1;
+	return debugfs_create_file_unsafe(filename, mode, parent, buf, &relay_file_operations);
+}
+
+static int tap_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
+
+static const struct rchan_callbacks tap_relay_cbs = {
+	.subbuf_start = tap_subbuf_start,
+	.create_buf_file = tap_create_buf_file,
+	.remove_buf_file = tap_remove_buf_file,
+};
+
+static int tap_enable_get(void *data, u64 *val)
+{
+	struct pcmtst_sub *sub = data;
+
+	*val = !!sub->tap_chan;
+	return 0;
+}
+
+// The tap can be enabled or disabled only while the substream is closed
+static int tap_enable_set(void *data, u64 val)
+{
+	struct pcmtst_sub *sub = data;
+	int err = 0;
+
+	mutex_lock(&sub->lock);
+	if (sub->opened) {
+		err = -EBUSY;
+	} else if (val && !sub->tap_chan) {
+		sub->tap_chan = relay_open("tap", sub->debug_dir, TAP_SUBBUF_SIZE, TAP_SUBBUF_CNT,
+					   &tap_relay_cbs, sub);
+		if (!sub->tap_chan)
+			err = -ENOMEM;
+		sub->tap_dropped = 0;
+	} else if (!val && sub->tap_chan) {
+		relay_close(sub->tap_chan);
+		sub->tap_chan = NULL;
+	}
+	mutex_unlock(&sub->lock);
+	return err;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(tap_enable_fops, tap_enable_get, tap_enable_set, "%llu\n");
+
+// The simple attributes pass the signed values as u64 as well
+static int override_get(void *data, u64 *val)
+{
+	*val = (s64)READ_ONCE(*(int *)data);
+	return 0;
+}
+
+static int override_set_range(void *data, u64 val, s64 min, s64 max)
+{
+	s64 sval = val;
+
+	if (sval != OVERRIDE_NONE && (sval < min || sval > max))
+		return -EINVAL;
+	WRITE_ONCE(*(int *)data, sval);
+	return 0;
+}
+
+static int delay_override_set(void *data, u64 val)
+{
+	return override_set_range(data, val, 0, INT_MAX);
+}
+DEFINE_DEBUGFS_ATTRIBUTE_SIGNED(delay_override_fops, override_get, delay_override_set, "%lld\n");
+
+static int fill_mode_override_set(void *data, u64 val)
+{
+	return override_set_range(data, val, FILL_MODE_RAND, FILL_MODE_CONST);
+}
+DEFINE_DEBUGFS_ATTRIBUTE_SIGNED(fill_mode_override_fops, override_get, fill_mode_override_set,
+				"%lld\n");
+
+static int err_override_set(void *data, u64 val)
+{
+	return override_set_range(data, val, 0, 1);
+}
+DEFINE_DEBUGFS_ATTRIBUTE_SIGNED(err_override_fops, override_get, err_override_set, "%lld\n");
+
+static int src_underflow_mode_get(void *data, u64 *val)
+{
+	*val = READ_ONCE(*(u32 *)data);
+	return 0;
+}
+
+static int src_underflow_mode_set(void *data, u64 val)
+{
+	if (val != SRC_UNDERFLOW_SILENCE && val != SRC_UNDERFLOW_REPEAT)
+		return -EINVAL;
+	WRITE_ONCE(*(u32 *)data, val);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(src_underflow_mode_fops, src_underflow_mode_get, src_underflow_mode_set,
+			 "%llu\n");
+
+static int inj_dc_set(void *data, u64 val)
 {
-	size_t in_cur_block = runtime->dma_bytes - v_iter->buf_pos;
+	s64 sval = val;
 
-	if (v_iter->b_rw <= in_cur_block) {
-		get_random_bytes(&runtime->dma_area[v_iter->buf_pos], v_iter->b_rw);
-	} else {
-		get_random_bytes(&runtime->dma_area[v_iter->buf_pos], in_cur_block);
-		get_random_bytes(runtime->dma_area, v_iter->b_rw - in_cur_block);
-	}
-	inc_buf_pos(v_iter, v_iter->b_rw, runtime->dma_bytes);
+	if (sval < INT_MIN || sval > INT_MAX)
+		return -EINVAL;
+	WRITE_ONCE(*(int *)data, sval);
+	return 0;
 }
+DEFINE_DEBUGFS_ATTRIBUTE_SIGNED(inj_dc_fops, override_get, inj_dc_set, "%lld\n");
 
-static void fill_block_random(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+static const char * const inj_rate_files[INJ_RANDOM_CNT] = {
+	[INJ_BIT_FLIP] = "inject_ber_ppb",
+	[INJ_DROP] = "inject_drop_ppm",
+	[INJ_DUP] = "inject_dup_ppm",
+	[INJ_SWAP] = "inject_swap_ppm",
+};
+
+static const char * const scn_action_names[SCN_ACTION_CNT] = {
+	[SCN_XRUN] = "xrun",
+	[SCN_STALL] = "stall",
+	[SCN_RATE] = "rate",
+	[SCN_FAIL_TRIGGER] = "fail_trigger",
+	[SCN_BANK] = "bank",
+};
+
+static int scenario_show(struct seq_file *s, void *data)
 {
-	if (v_iter->interleaved)
-		fill_block_rand_i(v_iter, runtime);
-	else
-		fill_block_rand_n(v_iter, runtime);
+	struct pcmtst_sub *sub = s->private;
+	const struct pcmtst_scn_action *act;
+	unsigned int i;
+
+	mutex_lock(&sub->lock);
+	for (i = 0; i < sub->scenario_len; i++) {
+		act = &sub->scenario[i];
+		seq_printf(s, "%llu %s %u\n", act->frame, scn_action_names[act->action], act->arg);
+	}
+	mutex_unlock(&sub->lock);
+	return 0;
 }
 
-static void fill_block(struct pcmtst_buf_iter *v_iter, struct snd_pcm_runtime *runtime)
+static int scenario_parse_line(char *line, struct pcmtst_scn_action *act)
 {
-	switch (fill_mode) {
-	case FILL_MODE_RAND:
-		fill_block_random(v_iter, runtime);
-		break;
-	case FILL_MODE_PAT:
-		fill_block_pattern(v_iter, runtime);
-		break;
+	char name[16];
+	int i, cnt;
+
+	act->arg = 0;
+	cnt = sscanf(line, "%llu %15s %u", &act->frame, name, &act->arg);
+	if (cnt < 2)
+		return -EINVAL;
+	for (i = 0; i < SCN_ACTION_CNT; i++) {
+		if (!strcmp(name, scn_action_names[i])) {
+			act->action = i;
+			return i == SCN_BANK && act->arg >= PATTERN_BANKS ? -EINVAL : 0;
+		}
 	}
+	return -EINVAL;
 }
 
 /*
- * Here we iterate through the buffer by (buffer_size / iterates_per_second) bytes.
- * The driver uses timer to simulate the hardware pointer moving, and notify the PCM middle layer
- * about period elapsed.
+ * Every write replaces the whole scenario. The lines have the '<frame> <action> [arg]' format,
+ * and the frames must not decrease. The timer reads the scenario without locks, so it can be
+ * changed only while the substream is closed.
  */
-static void timer_timeout(struct timer_list *data)
+static ssize_t scenario_write(struct file *file, const char __user *u_buff, size_t len,
+			      loff_t *off)
 {
-	struct pcmtst_buf_iter *v_iter;
-	struct snd_pcm_substream *substream;
-
-	v_iter = from_timer(v_iter, data, timer_instance);
-	substream = v_iter->substream;
+	struct pcmtst_sub *sub = file->f_inode->i_private;
+	struct pcmtst_scn_action *acts;
+	unsigned int cnt = 0;
+	char *buf, *cur, *line;
+	ssize_t res = len;
+
+	if (len > SCENARIO_MAX_INPUT)
+		return -E2BIG;
+	buf = memdup_user_nul(u_buff, len);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+	acts = kcalloc(SCENARIO_MAX_ACTIONS, sizeof(*acts), GFP_KERNEL);
+	if (!acts) {
+		res = -ENOMEM;
+		goto free_buf;
+	}
 
-	if (substream->stream == SNDRV_PCM_STREAM_PLAYBACK && !v_iter->is_buf_corrupted)
-		check_buf_block(v_iter, substream->runtime);
-	else if (substream->stream == SNDRV_PCM_STREAM_CAPTURE)
-		fill_block(v_iter, substream->runtime);
-	else
-		inc_buf_pos(v_iter, v_iter->b_rw, substream->runtime->dma_bytes);
+	cur = buf;
+	while ((line = strsep(&cur, "\n"))) {
+		line = strim(line);
+		if (!*line)
+			continue;
+		if (cnt == SCENARIO_MAX_ACTIONS || scenario_parse_line(line, &acts[cnt]) ||
+		    (cnt && acts[cnt].frame < acts[cnt - 1].frame)) {
+			res = -EINVAL;
+			goto free_acts;
+		}
+		cnt++;
+	}
 
-	v_iter->period_pos += v_iter->b_rw;
-	if (v_iter->period_pos >= v_iter->period_bytes) {
-		v_iter->period_pos %= v_iter->period_bytes;
-		snd_pcm_period_elapsed(substream);
+	mutex_lock(&sub->lock);
+	if (sub->opened) {
+		res = -EBUSY;
+	} else {
+		memcpy(sub->scenario, acts, cnt * sizeof(*acts));
+		sub->scenario_len = cnt;
 	}
-	mod_timer(&v_iter->timer_instance, jiffies + TIMER_INTERVAL + inject_delay);
+	mutex_unlock(&sub->lock);
+free_acts:
+	kfree(acts);
+free_buf:
+	kfree(buf);
+	return res;
 }
 
-static int snd_pcmtst_pcm_open(struct snd_pcm_substream *substream)
+static int scenario_open(struct inode *inode, struct file *file)
 {
-	struct snd_pcm_runtime *runtime = substream->runtime;
-	struct pcmtst_buf_iter *v_iter;
-
-	v_iter = kzalloc(sizeof(*v_iter), GFP_KERNEL);
-	if (!v_iter)
-		return -ENOMEM;
+	return single_open(file, scenario_show, inode->i_private);
+}
 
-	runtime->hw = snd_pcmtst_hw;
-	runtime->private_data = v_iter;
-	v_iter->substream = substream;
-	v_iter->buf_pos = 0;
-	v_iter->is_buf_corrupted = false;
-	v_iter->period_pos = 0;
-	v_iter->total_bytes = 0;
+static const struct file_operations scenario_fops = {
+	.owner = THIS_MODULE,
+	.open = scenario_open,
+	.read = seq_read,
+	.write = scenario_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	playback_capture_test = 0;
-	ioctl_reset_test = 0;
+// Per-open state of the trace file writer
+struct pcmtst_trace_load {
+	struct pcmtst_sub *sub;
+	struct pcmtst_trace_smp *smps;
+	unsigned int len;
+	char line[TRACE_MAX_LINE];
+	size_t line_len;
+	int err;
+	bool applied;
+};
 
-	timer_setup(&v_iter->timer_instance, timer_timeout, 0);
-	mod_timer(&v_iter->timer_instance, jiffies + TIMER_INTERVAL);
+static int trace_show(struct seq_file *s, void *data)
+{
+	struct pcmtst_sub *sub = s->private;
+	const struct pcmtst_trace_smp *smp;
+
+	mutex_lock(&sub->lock);
+	smp = sub->trace;
+	seq_printf(s, "samples: %u\n", sub->trace_len);
+	seq_printf(s, "last load error: %d\n", sub->trace_err);
+	if (sub->trace_len >= TRACE_MIN_SAMPLES) {
+		seq_printf(s, "duration: %llu us\n", smp[sub->trace_len - 1].usec - smp[0].usec);
+		seq_printf(s, "frames: %llu\n", smp[sub->trace_len - 1].frame - smp[0].frame);
+	}
+	mutex_unlock(&sub->lock);
 	return 0;
 }
 
-static int snd_pcmtst_pcm_close(struct snd_pcm_substream *substream)
+static int trace_add_line(struct pcmtst_trace_load *load)
 {
-	struct pcmtst_buf_iter *v_iter = substream->runtime->private_data;
+	struct pcmtst_trace_smp *smp;
+	char *line;
 
-	timer_shutdown_sync(&v_iter->timer_instance);
-	v_iter->substream = NULL;
-	playback_capture_test = !v_iter->is_buf_corrupted;
-	kfree(v_iter);
+	load->line[load->line_len] = '\0';
+	load->line_len = 0;
+	line = strim(load->line);
+	if (!*line || *line == '#')
+		return 0;
+	if (load->len == TRACE_MAX_SAMPLES)
+		return -E2BIG;
+
+	smp = &load->smps[load->len];
+	if (sscanf(line, "%llu %llu", &smp->usec, &smp->frame) != 2)
+		return -EINVAL;
+	if (load->len && (smp->usec <= smp[-1].usec || smp->frame < smp[-1].frame))
+		return -EINVAL;
+	load->len++;
 	return 0;
 }
 
-static int snd_pcmtst_pcm_trigger(struct snd_pcm_substream *substream, int cmd)
+// The trace can be written with any number of write() calls, it is applied on close (see flush)
+static ssize_t trace_write(struct file *file, const char __user *u_buff, size_t len, loff_t *off)
 {
-	struct snd_pcm_runtime *runtime = substream->runtime;
-	struct pcmtst_buf_iter *v_iter = runtime->private_data;
+	struct pcmtst_trace_load *load = file->private_data;
+	size_t done, chunk, i;
+	char buf[256];
+
+	for (done = 0; done < len && !load->err; done += chunk) {
+		chunk = min(len - done, sizeof(buf));
+		if (copy_from_user(buf, u_buff + done, chunk))
+			return -EFAULT;
+		for (i = 0; i < chunk && !load->err; i++) {
+			if (buf[i] == '\n')
+				load->err = trace_add_line(load);
+			else if (load->line_len == TRACE_MAX_LINE - 1)
+				load->err = -EINVAL;
+			else
+				load->line[load->line_len++] = buf[i];
+		}
+	}
+	return load->err ? load->err : len;
+}
+
+static int trace_open(struct inode *inode, struct file *file)
+{
+	struct pcmtst_sub *sub = inode->i_private;
+	struct pcmtst_trace_load *load;
+	bool opened;
 
-	if (inject_trigger_err)
+	if (!(file->f_mode & FMODE_WRITE))
+		return single_open(file, trace_show, sub);
+	if (file->f_mode & FMODE_READ)
 		return -EINVAL;
 
-	v_iter->sample_bytes = runtime->sample_bits / 8;
-	v_iter->period_bytes = frames_to_bytes(runtime, runtime->period_size);
-	if (runtime->access == SNDRV_PCM_ACCESS_RW_NONINTERLEAVED ||
-	    runtime->access == SNDRV_PCM_ACCESS_MMAP_NONINTERLEAVED) {
-		v_iter->chan_block = runtime->dma_bytes / runtime->channels;
-		v_iter->interleaved = false;
-	} else {
-		v_iter->interleaved = true;
-	}
-	// We want to record RATE * ch_cnt samples per sec, it is rate * sample_bytes * ch_cnt bytes
-	v_iter->s_rw_ch = runtime->rate / TIMER_PER_SEC;
-	v_iter->b_rw = v_iter->s_rw_ch * v_iter->sample_bytes * runtime->channels;
+	mutex_lock(&sub->lock);
+	opened = sub->opened;
+	mutex_unlock(&sub->lock);
+	if (opened)
+		return -EBUSY;
 
-	return 0;
+	load = kzalloc(sizeof(*load), GFP_KERNEL);
+	if (!load)
+		return -ENOMEM;
+	load->smps = vmalloc(TRACE_MAX_SAMPLES * sizeof(*load->smps));
+	if (!load->smps) {
+		kfree(load);
+		return -ENOMEM;
+	}
+	load->sub = sub;
+	file->private_data = load;
+	return nonseekable_open(inode, file);
 }
 
-static snd_pcm_uframes_t snd_pcmtst_pcm_pointer(struct snd_pcm_substream *substream)
+/*
+ * Apply the trace on the first close() of the writer, so the errors are returned by close().
+ * The result is also shown in the file, as the shell redirections don't check it.
+ */
+static int trace_flush(struct file *file, fl_owner_t id)
 {
-	struct pcmtst_buf_iter *v_iter = substream->runtime->private_data;
+	struct pcmtst_trace_load *load = file->private_data;
+	struct pcmtst_trace_smp *trace = NULL;
+	struct pcmtst_sub *sub;
 
-	return bytes_to_frames(substream->runtime, v_iter->buf_pos);
+	if (!(file->f_mode & FMODE_WRITE) || load->applied)
+		return 0;
+	load->applied = true;
+
+	sub = load->sub;
+	if (load->line_len && !load->err)
+		load->err = trace_add_line(load);
+	if (!load->err && load->len) {
+		trace = vmalloc(load->len * sizeof(*trace));
+		if (trace)
+			memcpy(trace, load->smps, load->len * sizeof(*trace));
+		else
+			load->err = -ENOMEM;
+	}
+
+	mutex_lock(&sub->lock);
+	// The timer reads the trace without locks, so replace it only while the substream is closed
+	if (!load->err && sub->opened)
+		load->err = -EBUSY;
+	if (!load->err) {
+		swap(sub->trace, trace);
+		sub->trace_len = load->len;
+	}
+	sub->trace_err = load->err;
+	mutex_unlock(&sub->lock);
+
+	vfree(trace);
+	return load->err;
 }
 
-static int snd_pcmtst_free(struct pcmtst *pcmtst)
+static int trace_release(struct inode *inode, struct file *file)
 {
-	if (!pcmtst)
-		return 0;
-	kfree(pcmtst);
+	struct pcmtst_trace_load *load = file->private_data;
+
+	if (!(file->f_mode & FMODE_WRITE))
+		return single_release(inode, file);
+
+	vfree(load->smps);
+	kfree(load);
 	return 0;
 }
 
-// These callbacks are required, but empty - all freeing occurs in pdev_remove
-static int snd_pcmtst_dev_free(struct snd_device *device)
+static const struct file_operations trace_fops = {
+	.owner = THIS_MODULE,
+	.open = trace_open,
+	.read = seq_read,
+	.write = trace_write,
+	.llseek = seq_lseek,
+	.flush = trace_flush,
+	.release = trace_release,
+};
+
+static int bank_show(struct seq_file *s, void *data)
 {
+	struct pcmtst_sub *sub = s->private;
+	u64 req = READ_ONCE(sub->bank_req);
+
+	seq_printf(s, "bank: %u\n", READ_ONCE(sub->bank));
+	seq_printf(s, "switches: %llu\n", sub->bank_switches);
+	if (sub->bank_switches)
+		seq_printf(s, "last switch frame: %llu\n", sub->bank_switch_frame);
+	if (req != BANK_REQ_NONE)
+		seq_printf(s, "pending: %llu at frame %llu\n",
+			   req & GENMASK_ULL(BANK_REQ_BITS - 1, 0), req >> BANK_REQ_BITS);
 	return 0;
 }
 
-static void pcmtst_pdev_release(struct device *dev)
+/*
+ * Writing '<bank>' switches the bank at the next frame the driver processes, '<bank> <frame>' -
+ * at the given frame, counted from the last 'prepare'. The new request replaces the pending one.
+ * While the substream is closed, '<bank>' and '<bank> 0' set the bank the next stream starts with.
+ */
+static ssize_t bank_write(struct file *file, const char __user *u_buff, size_t len, loff_t *off)
 {
-}
+	struct pcmtst_sub *sub = file->f_inode->i_private;
+	unsigned long long frame = 0;
+	unsigned int bank;
+	char buf[48];
 
-static int snd_pcmtst_pcm_prepare(struct snd_pcm_substream *substream)
-{
-	if (inject_prepare_err)
+	if (len >= sizeof(buf))
 		return -EINVAL;
-	return 0;
+	if (copy_from_user(buf, u_buff, len))
+		return -EFAULT;
+	buf[len] = '\0';
+	if (sscanf(buf, "%u %llu", &bank, &frame) < 1 || bank >= PATTERN_BANKS ||
+	    frame >= BANK_REQ_NONE >> BANK_REQ_BITS)
+		return -EINVAL;
+
+	mutex_lock(&sub->lock);
+	if (!sub->opened && !frame) {
+		sub->bank = bank;
+		sub->bank_req = BANK_REQ_NONE;
+	} else {
+		WRITE_ONCE(sub->bank_req, (frame << BANK_REQ_BITS) | bank);
+	}
+	mutex_unlock(&sub->lock);
+	return len;
 }
 
-static int snd_pcmtst_pcm_hw_params(struct snd_pcm_substream *substream,
-				    struct snd_pcm_hw_params *params)
+static int bank_open(struct inode *inode, struct file *file)
 {
-	if (inject_hwpars_err)
-		return -EBUSY;
-	return 0;
+	return single_open(file, bank_show, inode->i_private);
 }
 
-static int snd_pcmtst_pcm_hw_free(struct snd_pcm_substream *substream)
+static const struct file_operations bank_fops = {
+	.owner = THIS_MODULE,
+	.open = bank_open,
+	.read = seq_read,
+	.write = bank_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int source_open(struct inode *inode, struct file *file)
 {
-	return 0;
+	struct pcmtst_sub *sub = inode->i_private;
+	struct pcmtst_src_ctl *ctl;
+	int err;
+
+	err = debugfs_file_get(file->f_path.dentry);
+	if (err)
+		return err;
+	mutex_lock(&sub->lock);
+	if (!sub->src) {
+		ctl = vmalloc_user(SRC_DATA_OFFSET + SRC_DATA_SIZE);
+		if (!ctl) {
+			err = -ENOMEM;
+			goto unlock;
+		}
+		ctl->magic = SRC_MAGIC;
+		ctl->version = SRC_VERSION;
+		ctl->data_offset = SRC_DATA_OFFSET;
+		ctl->data_size = SRC_DATA_SIZE;
+		// Pairs with the timer, which reads the pointer locklessly
+		smp_store_release(&sub->src, ctl);
+	}
+	file->private_data = sub;
+unlock:
+	mutex_unlock(&sub->lock);
+	debugfs_file_put(file->f_path.dentry);
+	return err;
 }
 
-static int snd_pcmtst_ioctl(struct snd_pcm_substream *substream, unsigned int cmd, void *arg)
+// The alternative to mmap: append the data to the ring, as much as fits
+static ssize_t source_write(struct file *file, const char __user *u_buff, size_t len, loff_t *off)
 {
-	switch (cmd) {
-	case SNDRV_PCM_IOCTL1_RESET:
-		ioctl_reset_test = 1;
-		break;
+	struct pcmtst_sub *sub = file->private_data;
+	struct pcmtst_src_ctl *ctl;
+	size_t pos, chunk;
+	u64 head, tail;
+	ssize_t res;
+	u8 *data;
+
+	res = debugfs_file_get(file->f_path.dentry);
+	if (res)
+		return res;
+	mutex_lock(&sub->lock);
+	ctl = sub->src;
+	data = (u8 *)ctl + SRC_DATA_OFFSET;
+	head = ctl->head;
+	tail = smp_load_acquire(&sub->src_tail);
+	len = min_t(u64, len, SRC_DATA_SIZE - min_t(u64, head - tail, SRC_DATA_SIZE));
+	if (!len) {
+		res = -EAGAIN;
+		goto unlock;
 	}
-	return snd_pcm_lib_ioctl(substream, cmd, arg);
+
+	pos = head & (SRC_DATA_SIZE - 1);
+	chunk = min_t(size_t, len, SRC_DATA_SIZE - pos);
+	if (copy_from_user(data + pos, u_buff, chunk) ||
+	    copy_from_user(data, u_buff + chunk, len - chunk)) {
+		res = -EFAULT;
+		goto unlock;
+	}
+	// Pairs with the timer reading the head
+	smp_store_release(&ctl->head, head + len);
+	res = len;
+unlock:
+	mutex_unlock(&sub->lock);
+	debugfs_file_put(file->f_path.dentry);
+	return res;
 }
 
-static const struct snd_pcm_ops snd_pcmtst_playback_ops = {
-	.open =		snd_pcmtst_pcm_open,
-	.close =	snd_pcmtst_pcm_close,
-	.trigger =	snd_pcmtst_pcm_trigger,
-	.hw_params =	snd_pcmtst_pcm_hw_params,
-	.ioctl =	snd_pcmtst_ioctl,
-	.hw_free =	snd_pcmtst_pcm_hw_free,
-	.prepare =	snd_pcmtst_pcm_prepare,
-	.pointer =	snd_pcmtst_pcm_pointer,
-};
+static int source_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pcmtst_sub *sub = file->private_data;
+	int err;
 
-static const struct snd_pcm_ops snd_pcmtst_capture_ops = {
-	.open =		snd_pcmtst_pcm_open,
-	.close =	snd_pcmtst_pcm_close,
-	.trigger =	snd_pcmtst_pcm_trigger,
-	.hw_params =	snd_pcmtst_pcm_hw_params,
-	.hw_free =	snd_pcmtst_pcm_hw_free,
-	.ioctl =	snd_pcmtst_ioctl,
-	.prepare =	snd_pcmtst_pcm_prepare,
-	.pointer =	snd_pcmtst_pcm_pointer,
+	err = debugfs_file_get(file->f_path.dentry);
+	if (err)
+		return err;
+	err = remap_vmalloc_range(vma, sub->src, vma->vm_pgoff);
+	debugfs_file_put(file->f_path.dentry);
+	return err;
+}
+
+// debugfs proxy doesn't support mmap, so the file is created 'unsafe' and protects itself
+static const struct file_operations source_fops = {
+	.owner = THIS_MODULE,
+	.open = source_open,
+	.write = source_write,
+	.mmap = source_mmap,
+	.llseek = no_llseek,
 };
 
-static int snd_pcmtst_new_pcm(struct pcmtst *pcmtst)
+static void init_sub_debug_files(struct pcmtst_sub *sub, struct dentry *parent, int stream,
+				 int number)
 {
-	struct snd_pcm *pcm;
-	int err;
+	struct dentry *dir;
+	char name[16];
+	int i;
 
-	err = snd_pcm_new(pcmtst->card, "PCMTest", 0, PLAYBACK_SUBSTREAM_CNT,
-			  CAPTURE_SUBSTREAM_CNT, &pcm);
-	if (err < 0)
-		return err;
-	pcm->private_data = pcmtst;
-	strcpy(pcm->name, "PCMTest");
-	pcmtst->pcm = pcm;
-	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &snd_pcmtst_playback_ops);
-	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &snd_pcmtst_capture_ops);
+	snprintf(name, sizeof(name), "sub%d", number);
+	dir = debugfs_create_dir(name, parent);
+	sub->debug_dir = dir;
+	debugfs_create_file("headroom", 0444, dir, sub, &headroom_fops);
+	debugfs_create_file("wakeup_latency", 0444, dir, sub, &wakeup_latency_fops);
+	debugfs_create_file("ioctl_stats", 0444, dir, sub, &ioctl_stats_fops);
+	debugfs_create_file("corruption", 0444, dir, sub, &corruption_fops);
+	debugfs_create_file("sequence", 0444, dir, sub, &sequence_fops);
+	debugfs_create_file("scenario", 0600, dir, sub, &scenario_fops);
+	debugfs_create_u32("rate_scale", 0600, dir, &sub->rate_scale);
+	debugfs_create_file("bank", 0600, dir, sub, &bank_fops);
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		debugfs_create_u32("verify_every", 0600, dir, &sub->verify_every);
+		debugfs_create_u32("verify_percent", 0600, dir, &sub->verify_percent);
+	}
+	debugfs_create_file("trace", 0600, dir, sub, &trace_fops);
+	debugfs_create_file_unsafe("fill_mode", 0600, dir, &sub->ovr.fill_mode,
+				   &fill_mode_override_fops);
+	debugfs_create_file_unsafe("inject_delay", 0600, dir, &sub->ovr.inject_delay,
+				   &delay_override_fops);
+	debugfs_create_file_unsafe("inject_hwpars_err", 0600, dir, &sub->ovr.inject_hwpars_err,
+				   &err_override_fops);
+	debugfs_create_file_unsafe("inject_prepare_err", 0600, dir, &sub->ovr.inject_prepare_err,
+				   &err_override_fops);
+	debugfs_create_file_unsafe("inject_trigger_err", 0600, dir, &sub->ovr.inject_trigger_err,
+				   &err_override_fops);
+	if (stream == SNDRV_PCM_STREAM_PLAYBACK) {
+		debugfs_create_file("crc", 0400, dir, &sub->crc_ring, &ring_fops);
+		debugfs_create_u64("crc_dropped", 0444, dir, &sub->crc_ring.dropped);
+		debugfs_create_file_unsafe("tap_enable", 0600, dir, sub, &tap_enable_fops);
+		debugfs_create_u64("tap_dropped", 0444, dir, &sub->tap_dropped);
+	} else {
+		debugfs_create_file_unsafe("source", 0600, dir, sub, &source_fops);
+		debugfs_create_file_unsafe("source_underflow_mode", 0600, dir,
+					   &sub->src_underflow_mode, &src_underflow_mode_fops);
+		debugfs_create_u64("source_underflows", 0444, dir, &sub->src_underflows);
+		debugfs_create_u64("source_underflow_frames", 0444, dir,
+				   &sub->src_underflow_frames);
+		for (i = 0; i < INJ_RANDOM_CNT; i++)
+			debugfs_create_u32(inj_rate_files[i], 0600, dir, &sub->inj_rate[i]);
+		debugfs_create_file_unsafe("inject_dc_offset", 0600, dir, &sub->inj_dc,
+					   &inj_dc_fops);
+		debugfs_create_u64("inject_seed", 0600, dir, &sub->inj_seed);
+		debugfs_create_file("injected", 0400, dir, &sub->inj_ring, &ring_fops);
+		debugfs_create_u64("injected_dropped", 0444, dir, &sub->inj_ring.dropped);
+	}
+}
 
-	err = snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_DEV, &pcmtst->pdev->dev,
-					     0, 128 * 1024);
-	return err;
+/*
+ * The per-substream debugfs entries follow the procfs layout of ALSA:
+ * /sys/kernel/debug/pcmtest/pcm0p/sub0/...
+ */
+static void init_pcm_debug_files(struct pcmtst_dev *dev, int device)
+{
+	struct dentry *dir;
+	char name[16];
+	int i;
+
+	snprintf(name, sizeof(name), "pcm%dp", device);
+	dir = debugfs_create_dir(name, driver_debug_dir);
+	dev->debug_dirs[SNDRV_PCM_STREAM_PLAYBACK] = dir;
+	for (i = 0; i < PLAYBACK_SUBSTREAM_CNT; i++)
+		init_sub_debug_files(&dev->playback_subs[i], dir, SNDRV_PCM_STREAM_PLAYBACK, i);
+
+	snprintf(name, sizeof(name), "pcm%dc", device);
+	dir = debugfs_create_dir(name, driver_debug_dir);
+	dev->debug_dirs[SNDRV_PCM_STREAM_CAPTURE] = dir;
+	for (i = 0; i < CAPTURE_SUBSTREAM_CNT; i++)
+		init_sub_debug_files(&dev->capture_subs[i], dir, SNDRV_PCM_STREAM_CAPTURE, i);
+}
+
+static void init_sub(struct pcmtst_sub *sub)
+{
+	mutex_init(&sub->lock);
+	sub->rate_scale = 100;
+	sub->verify_every = 1;
+	sub->verify_percent = 100;
+	sub->bank_req = BANK_REQ_NONE;
+	sub->ovr.fill_mode = OVERRIDE_NONE;
+	sub->ovr.inject_delay = OVERRIDE_NONE;
+	sub->ovr.inject_hwpars_err = OVERRIDE_NONE;
+	sub->ovr.inject_prepare_err = OVERRIDE_NONE;
+	sub->ovr.inject_trigger_err = OVERRIDE_NONE;
+}
+
+static int snd_pcmtst_dev_init(struct pcmtst *pcmtst, int device)
+{
+	struct pcmtst_dev *dev = &pcmtst->devs[device];
+	int i, err;
+
+	dev->pcmtst = pcmtst;
+	dev->profile = dev_profiles[device];
+	for (i = 0; i < PLAYBACK_SUBSTREAM_CNT; i++)
+		init_sub(&dev->playback_subs[i]);
+	for (i = 0; i < CAPTURE_SUBSTREAM_CNT; i++)
+		init_sub(&dev->capture_subs[i]);
+	for (i = 0; i < PLAYBACK_SUBSTREAM_CNT; i++) {
+		err = ring_init(&dev->playback_subs[i].crc_ring, sizeof(struct pcmtst_crc_rec),
+				CRC_RING_RECS);
+		if (err < 0)
+			return err;
+	}
+	for (i = 0; i < CAPTURE_SUBSTREAM_CNT; i++) {
+		err = ring_init(&dev->capture_subs[i].inj_ring, sizeof(struct pcmtst_inj_rec),
+				INJ_RING_RECS);
+		if (err < 0)
+			return err;
+	}
+	return 0;
 }
 
 static int snd_pcmtst_create(struct snd_card *card, struct platform_device *pdev,
 			     struct pcmtst **r_pcmtst)
 {
 	struct pcmtst *pcmtst;
-	int err;
+	int i, err;
 	static const struct snd_device_ops ops = {
 		.dev_free = snd_pcmtst_dev_free,
 	};
 
-	pcmtst = kzalloc(sizeof(*pcmtst), GFP_KERNEL);
+	// The per-substream state of several devices is too big for kzalloc
+	pcmtst = kvzalloc(sizeof(*pcmtst), GFP_KERNEL);
 	if (!pcmtst)
 		return -ENOMEM;
 	pcmtst->card = card;
 	pcmtst->pdev = pdev;
 
-	err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, pcmtst, &ops);
+	err = ring_init(&pcmtst->events, sizeof(struct pcmtst_event), EVENT_RING_RECS);
 	if (err < 0)
 		goto _err_free_chip;
+	for (i = 0; i < pcm_devs; i++) {
+		pcmtst->dev_cnt++;
+		err = snd_pcmtst_dev_init(pcmtst, i);
+		if (err < 0)
+			goto _err_free_chip;
+	}
 
-	err = snd_pcmtst_new_pcm(pcmtst);
+	err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, pcmtst, &ops);
 	if (err < 0)
 		goto _err_free_chip;
 
+	// From now on pcmtst is freed together with the card
+	for (i = 0; i < pcmtst->dev_cnt; i++) {
+		err = snd_pcmtst_new_pcm(pcmtst, i);
+		if (err < 0)
+			return err;
+	}
+
+	err = init_stats_page(pcmtst);
+	if (err < 0)
+		return err;
+
+	pcmtst->events_file = debugfs_create_file("events", 0400, driver_debug_dir,
+						  &pcmtst->events, &ring_fops);
+	debugfs_create_u64("events_dropped", 0444, driver_debug_dir, &pcmtst->events.dropped);
+
+	for (i = 0; i < pcmtst->dev_cnt; i++)
+		init_pcm_debug_files(&pcmtst->devs[i], i);
+
 	*r_pcmtst = pcmtst;
 	return 0;
 
@@ -577,13 +3353,6 @@ static int pcmtst_probe(struct platform_device *pdev)
 	return 0;
 }
 
-static void pdev_remove(struct platform_device *pdev)
-{
-	struct pcmtst *pcmtst = platform_get_drvdata(pdev);
-
-	snd_pcmtst_free(pcmtst);
-}
-
 static struct platform_device pcmtst_pdev = {
 	.name =		"pcmtest",
 	.dev.release =	pcmtst_pdev_release,
@@ -591,7 +3360,6 @@ static struct platform_device pcmtst_pdev = {
 
 static struct platform_driver pcmtst_pdrv = {
 	.probe =	pcmtst_probe,
-	.remove_new =	pdev_remove,
 	.driver =	{
 		.name = "pcmtest",
 	},
@@ -614,6 +3382,9 @@ static ssize_t pattern_write(struct file *file, const char __user *u_buff, size_
 
 	patt_buf->len = *off + to_write;
 	*off += to_write;
+	// Pairs with prerender(): the new pattern is visible before the new generation
+	smp_wmb();
+	WRITE_ONCE(patt_gen, patt_gen + 1);
 
 	return to_write;
 }
@@ -641,18 +3412,25 @@ static const struct file_operations fill_pattern_fops = {
 	.write = pattern_write,
 };
 
+// Returns the count of channel patterns allocated in all the banks
 static int setup_patt_bufs(void)
 {
-	size_t i;
-
-	for (i = 0; i < ARRAY_SIZE(patt_bufs); i++) {
-		patt_bufs[i].buf = kzalloc(MAX_PATTERN_LEN, GFP_KERNEL);
-		if (!patt_bufs[i].buf)
-			break;
-		strcpy(patt_bufs[i].buf, DEFAULT_PATTERN);
-		patt_bufs[i].len = DEFAULT_PATTERN_LEN;
+	size_t i, bank;
+
+	for (i = 0; i < MAX_PATTERNS; i++) {
+		for (bank = 0; bank < PATTERN_BANKS; bank++) {
+			patt_bufs[bank][i].buf = kzalloc(MAX_PATTERN_LEN, GFP_KERNEL);
+			if (!patt_bufs[bank][i].buf)
+				goto err_free_channel;
+			strcpy(patt_bufs[bank][i].buf, DEFAULT_PATTERN);
+			patt_bufs[bank][i].len = DEFAULT_PATTERN_LEN;
+		}
 	}
+	return i;
 
+err_free_channel:
+	while (bank--)
+		kfree(patt_bufs[bank][i].buf);
 	return i;
 }
 
@@ -660,8 +3438,9 @@ static const char * const pattern_files[] = { "fill_pattern0", "fill_pattern1",
 					      "fill_pattern2", "fill_pattern3"};
 static int init_debug_files(int buf_count)
 {
-	size_t i;
+	size_t i, bank;
 	char len_file_name[32];
+	struct dentry *dir;
 
 	driver_debug_dir = debugfs_create_dir("pcmtest", NULL);
 	if (IS_ERR(driver_debug_dir))
@@ -669,11 +3448,19 @@ static int init_debug_files(int buf_count)
 	debugfs_create_u8("pc_test", 0444, driver_debug_dir, &playback_capture_test);
 	debugfs_create_u8("ioctl_test", 0444, driver_debug_dir, &ioctl_reset_test);
 
-	for (i = 0; i < buf_count; i++) {
-		debugfs_create_file(pattern_files[i], 0600, driver_debug_dir,
-				    &patt_bufs[i], &fill_pattern_fops);
-		snprintf(len_file_name, sizeof(len_file_name), "%s_len", pattern_files[i]);
-		debugfs_create_u32(len_file_name, 0444, driver_debug_dir, &patt_bufs[i].len);
+	// Bank 0 lives in the root directory, the rest - in the bankN subdirectories
+	for (bank = 0; bank < PATTERN_BANKS; bank++) {
+		dir = driver_debug_dir;
+		if (bank) {
+			snprintf(len_file_name, sizeof(len_file_name), "bank%zu", bank);
+			dir = debugfs_create_dir(len_file_name, driver_debug_dir);
+		}
+		for (i = 0; i < buf_count; i++) {
+			debugfs_create_file(pattern_files[i], 0600, dir, &patt_bufs[bank][i],
+					    &fill_pattern_fops);
+			snprintf(len_file_name, sizeof(len_file_name), "%s_len", pattern_files[i]);
+			debugfs_create_u32(len_file_name, 0444, dir, &patt_bufs[bank][i].len);
+		}
 	}
 
 	return 0;
@@ -681,10 +3468,11 @@ static int init_debug_files(int buf_count)
 
 static void free_pattern_buffers(void)
 {
-	int i;
+	int i, bank;
 
-	for (i = 0; i < buf_allocated; i++)
-		kfree(patt_bufs[i].buf);
+	for (bank = 0; bank < PATTERN_BANKS; bank++)
+		for (i = 0; i < buf_allocated; i++)
+			kfree(patt_bufs[bank][i].buf);
 }
 
 static void clear_debug_files(void)
@@ -692,16 +3480,37 @@ static void clear_debug_files(void)
 	debugfs_remove_recursive(driver_debug_dir);
 }
 
+static int resolve_profiles(void)
+{
+	int i, j;
+
+	for (i = 0; i < pcm_devs; i++) {
+		for (j = 0; j < ARRAY_SIZE(pcmtst_profiles); j++) {
+			if (!strcmp(pcm_profiles[i], pcmtst_profiles[j].name)) {
+				dev_profiles[i] = &pcmtst_profiles[j];
+				break;
+			}
+		}
+		if (!dev_profiles[i]) {
+			pr_err("pcmtest: unknown profile '%s'\n", pcm_profiles[i]);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 static int __init mod_init(void)
 {
 	int err = 0;
 
+	err = resolve_profiles();
+	if (err)
+		return err;
+
 	buf_allocated = setup_patt_bufs();
 	if (!buf_allocated)
 		return -ENOMEM;
 
-	snd_pcmtst_hw.channels_max = buf_allocated;
-
 	err = init_debug_files(buf_allocated);
 	if (err)
 		return err;
@@ -716,11 +3525,12 @@ static int __init mod_init(void)
 
 static void __exit mod_exit(void)
 {
-	clear_debug_files();
-	free_pattern_buffers();
-
+	// The device removes its own debugfs entries, so unregister it before the root directory
 	platform_driver_unregister(&pcmtst_pdrv);
 	platform_device_unregister(&pcmtst_pdev);
+
+	clear_debug_files();
+	free_pattern_buffers();
 }
 
 MODULE_LICENSE("GPL");
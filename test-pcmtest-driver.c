@@ -6,17 +6,45 @@
  * Copyright 2023 Ivan Orlov <ivan.orlov0322@gmail.com>
  */
 #include <string.h>
+#include <time.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <alsa/asoundlib.h>
 #include "../kselftest_harness.h"
 
-#define CH_NUM 4
+// The driver repeats the patterns if there are more channels
+#define PATTERN_NUM 4
+#define PATTERN_BANKS 4
+#define SUBSTREAM_CNT 8
+
+#define DEBUG_DIR "/sys/kernel/debug/pcmtest"
+#define STRESS_TIME_ENV "PCMTEST_STRESS_TIME"
+#define STRESS_DEFAULT_TIME 5
+#define LATENCY_BOUND_ENV "PCMTEST_LATENCY_BOUND_US"
+#define DEFAULT_TICK_MS 200
+
+#define EVENT_PERIOD 1
 
 struct pattern_buf {
 	char buf[1024];
 	int len;
 };
 
-struct pattern_buf patterns[CH_NUM];
+struct pattern_buf patterns[PATTERN_NUM];
+
+// Record of the driver event stream, see 'struct pcmtst_event' in the driver
+struct pcmtest_event {
+	uint64_t ts_ns;
+	uint64_t hw_ptr;
+	uint32_t arg;
+	uint16_t type;
+	uint8_t stream;
+	uint8_t number;
+	uint8_t device;
+	uint8_t reserved[7];
+};
 
 struct pcmtest_test_params {
 	unsigned long buffer_size;
@@ -30,34 +58,83 @@ struct pcmtest_test_params {
 	snd_pcm_format_t format;
 };
 
-static int read_patterns(void)
+// Bank 0 lives in the root debugfs directory, the others - in the 'bankN' subdirectories
+static void bank_dir(char *dir, size_t len, int bank)
+{
+	if (bank)
+		snprintf(dir, len, DEBUG_DIR "/bank%d", bank);
+	else
+		snprintf(dir, len, DEBUG_DIR);
+}
+
+static int read_bank_patterns(int bank, struct pattern_buf *bufs)
 {
 	FILE *fp, *fpl;
 	int i;
-	char pf[64];
-	char plf[64];
+	char dir[64];
+	char pf[96];
+	char plf[96];
 
-	for (i = 0; i < CH_NUM; i++) {
-		sprintf(plf, "/sys/kernel/debug/pcmtest/fill_pattern%d_len", i);
+	bank_dir(dir, sizeof(dir), bank);
+	for (i = 0; i < PATTERN_NUM; i++) {
+		sprintf(plf, "%s/fill_pattern%d_len", dir, i);
 		fpl = fopen(plf, "r");
 		if (!fpl)
 			return -1;
-		fscanf(fpl, "%u", &patterns[i].len);
+		fscanf(fpl, "%u", &bufs[i].len);
 		fclose(fpl);
 
-		sprintf(pf, "/sys/kernel/debug/pcmtest/fill_pattern%d", i);
+		sprintf(pf, "%s/fill_pattern%d", dir, i);
 		fp = fopen(pf, "r");
-		if (!fp) {
-			fclose(fpl);
+		if (!fp)
 			return -1;
-		}
-		fread(patterns[i].buf, 1, patterns[i].len, fp);
+		fread(bufs[i].buf, 1, bufs[i].len, fp);
 		fclose(fp);
 	}
 
 	return 0;
 }
 
+static int read_patterns(void)
+{
+	return read_bank_patterns(0, patterns);
+}
+
+static int write_debug_file(const char *path, const char *buf, size_t len)
+{
+	FILE *f;
+	size_t res;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	res = fwrite(buf, 1, len, f);
+	if (fclose(f) || res != len)
+		return -1;
+	return 0;
+}
+
+// Value of the 'key: value' line of a debugfs file, or -1
+static long long get_debug_stat(const char *path, const char *key)
+{
+	long long val = -1;
+	char line[128];
+	size_t len = strlen(key);
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, key, len) && line[len] == ':') {
+			sscanf(line + len + 1, "%lld", &val);
+			break;
+		}
+	}
+	fclose(f);
+	return val;
+}
+
 static int get_test_results(char *debug_name)
 {
 	int result;
@@ -82,14 +159,124 @@ static size_t get_sec_buf_len(unsigned int rate, unsigned long channels, snd_pcm
 	return rate * channels * snd_pcm_format_physical_width(format) / 8;
 }
 
-static int setup_handle(snd_pcm_t **handle, snd_pcm_sw_params_t *swparams,
-			snd_pcm_hw_params_t *hwparams, struct pcmtest_test_params *params,
-			int card, snd_pcm_stream_t stream)
+// Expected byte of the looped patterns at the position 'i' of the interleaved data
+static unsigned char pattern_byte_i(struct pcmtest_test_params *params,
+				    const struct pattern_buf *patts, size_t i)
+{
+	int cur_ch = (i / params->sample_size) % params->channels;
+	size_t pos_in_ch = i / params->sample_size / params->channels * params->sample_size
+			   + (i % params->sample_size);
+
+	cur_ch %= PATTERN_NUM;
+	return patts[cur_ch].buf[pos_in_ch % patts[cur_ch].len];
+}
+
+static double cpu_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// The CPU time includes the time spent in the kernel, so RW and mmap transfers are comparable
+static void report_cpu(const char *mode, double start_ms, size_t bytes)
+{
+	ksft_print_msg("%s: %.3f ms of CPU per MB\n", mode,
+		       (cpu_time_ms() - start_ms) * 1024 * 1024 / bytes);
+}
+
+/*
+ * Address of the frame 'frame' of the channel 'ch' in the application buffers: one buffer for the
+ * interleaved access, or one buffer per channel for the non-interleaved one
+ */
+static unsigned char *app_sample(struct pcmtest_test_params *params, void **bufs,
+				 snd_pcm_uframes_t frame, unsigned int ch)
+{
+	if (params->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+		return (unsigned char *)bufs[0] +
+		       (frame * params->channels + ch) * params->sample_size;
+	return (unsigned char *)bufs[ch] + frame * params->sample_size;
+}
+
+/*
+ * Transfer the frames through the mmap-ed DMA buffer, like snd_pcm_mmap_writei/readi do. The
+ * stream is started when the buffer is full (or empty for capture), and the playback is drained.
+ */
+static int mmap_transfer(snd_pcm_t *handle, struct pcmtest_test_params *params, void **bufs,
+			 snd_pcm_uframes_t frames, snd_pcm_stream_t stream)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t done = 0, offset, size;
+	snd_pcm_sframes_t avail, committed;
+	unsigned char *dma, *app;
+	size_t bytes;
+	unsigned int ch, chunk;
+	int err;
+
+	while (done < frames) {
+		avail = snd_pcm_avail_update(handle);
+		if (avail < 0)
+			return avail;
+		chunk = params->period_size < frames - done ? params->period_size : frames - done;
+		if (avail < chunk) {
+			if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+				err = snd_pcm_start(handle);
+				if (err < 0)
+					return err;
+			}
+			err = snd_pcm_wait(handle, 1000);
+			if (err < 0)
+				return err;
+			continue;
+		}
+
+		size = frames - done;
+		err = snd_pcm_mmap_begin(handle, &areas, &offset, &size);
+		if (err < 0)
+			return err;
+		for (ch = 0; ch < params->channels; ch++) {
+			dma = (unsigned char *)areas[ch].addr + areas[ch].first / 8 +
+			      offset * areas[ch].step / 8;
+			app = app_sample(params, bufs, done, ch);
+			// All the channels share one area in the interleaved mode
+			if (params->access == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+				bytes = size * params->channels * params->sample_size;
+				if (stream == SND_PCM_STREAM_PLAYBACK)
+					memcpy(dma, app, bytes);
+				else
+					memcpy(app, dma, bytes);
+				break;
+			}
+			if (stream == SND_PCM_STREAM_PLAYBACK)
+				memcpy(dma, app, size * params->sample_size);
+			else
+				memcpy(app, dma, size * params->sample_size);
+		}
+		committed = snd_pcm_mmap_commit(handle, offset, size);
+		if (committed < 0)
+			return committed;
+		done += committed;
+	}
+
+	if (stream == SND_PCM_STREAM_CAPTURE)
+		return 0;
+	if (snd_pcm_state(handle) == SND_PCM_STATE_PREPARED) {
+		err = snd_pcm_start(handle);
+		if (err < 0)
+			return err;
+	}
+	return snd_pcm_drain(handle);
+}
+
+static int setup_handle_sub(snd_pcm_t **handle, snd_pcm_sw_params_t *swparams,
+			    snd_pcm_hw_params_t *hwparams, struct pcmtest_test_params *params,
+			    int card, int subdevice, snd_pcm_stream_t stream)
 {
 	char pcm_name[32];
 	int err;
 
-	sprintf(pcm_name, "hw:%d,0,0", card);
+	sprintf(pcm_name, "hw:%d,0,%d", card, subdevice);
 	err = snd_pcm_open(handle, pcm_name, stream, 0);
 	if (err < 0)
 		return err;
@@ -101,7 +288,9 @@ static int setup_handle(snd_pcm_t **handle, snd_pcm_sw_params_t *swparams,
 	snd_pcm_hw_params_set_rate_near(*handle, hwparams, &params->rate, 0);
 	snd_pcm_hw_params_set_period_size_near(*handle, hwparams, &params->period_size, 0);
 	snd_pcm_hw_params_set_buffer_size_near(*handle, hwparams, &params->buffer_size);
-	snd_pcm_hw_params(*handle, hwparams);
+	err = snd_pcm_hw_params(*handle, hwparams);
+	if (err < 0)
+		return err;
 	snd_pcm_sw_params_current(*handle, swparams);
 
 	snd_pcm_hw_params_set_rate_resample(*handle, hwparams, 0);
@@ -114,6 +303,32 @@ static int setup_handle(snd_pcm_t **handle, snd_pcm_sw_params_t *swparams,
 	return 0;
 }
 
+static int setup_handle(snd_pcm_t **handle, snd_pcm_sw_params_t *swparams,
+			snd_pcm_hw_params_t *hwparams, struct pcmtest_test_params *params,
+			int card, snd_pcm_stream_t stream)
+{
+	return setup_handle_sub(handle, swparams, hwparams, params, card, 0, stream);
+}
+
+static int find_card(void)
+{
+	char *card_name;
+	int card = -1;
+	int found;
+
+	while (snd_card_next(&card) >= 0) {
+		if (card == -1)
+			break;
+		if (snd_card_get_name(card, &card_name) < 0)
+			continue;
+		found = !strcmp(card_name, "PCM-Test");
+		free(card_name);
+		if (found)
+			break;
+	}
+	return card;
+}
+
 FIXTURE(pcmtest) {
 	int card;
 	snd_pcm_sw_params_t *swparams;
@@ -121,11 +336,104 @@ FIXTURE(pcmtest) {
 	struct pcmtest_test_params params;
 };
 
+/*
+ * The variants cover the hardware envelope of the default profile: every rate class, both
+ * formats, 1-4 channels and several buffer/period ratios. The tick of the default profile is
+ * 200ms, so the buffer must be longer than that, while the period may be much shorter.
+ */
+FIXTURE_VARIANT(pcmtest) {
+	unsigned int rate;
+	snd_pcm_format_t format;
+	unsigned long channels;
+	unsigned long buffer_size;
+	unsigned long period_size;
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, u8_mono_8000) {
+	.rate = 8000,
+	.format = SND_PCM_FORMAT_U8,
+	.channels = 1,
+	.buffer_size = 16384,
+	.period_size = 4096,
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, s16_4ch_8000) {
+	.rate = 8000,
+	.format = SND_PCM_FORMAT_S16_LE,
+	.channels = 4,
+	.buffer_size = 16384,
+	.period_size = 4096,
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, s16_mono_8000_32_periods) {
+	.rate = 8000,
+	.format = SND_PCM_FORMAT_S16_LE,
+	.channels = 1,
+	.buffer_size = 65536,
+	.period_size = 2048,
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, s16_stereo_11025) {
+	.rate = 11025,
+	.format = SND_PCM_FORMAT_S16_LE,
+	.channels = 2,
+	.buffer_size = 16384,
+	.period_size = 4096,
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, u8_3ch_16000) {
+	.rate = 16000,
+	.format = SND_PCM_FORMAT_U8,
+	.channels = 3,
+	.buffer_size = 32768,
+	.period_size = 8192,
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, s16_mono_22050) {
+	.rate = 22050,
+	.format = SND_PCM_FORMAT_S16_LE,
+	.channels = 1,
+	.buffer_size = 16384,
+	.period_size = 2048,
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, s16_stereo_32000) {
+	.rate = 32000,
+	.format = SND_PCM_FORMAT_S16_LE,
+	.channels = 2,
+	.buffer_size = 32768,
+	.period_size = 4096,
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, u8_stereo_44100_2_periods) {
+	.rate = 44100,
+	.format = SND_PCM_FORMAT_U8,
+	.channels = 2,
+	.buffer_size = 32768,
+	.period_size = 16384,
+};
+
+FIXTURE_VARIANT_ADD(pcmtest, s16_4ch_48000) {
+	.rate = 48000,
+	.format = SND_PCM_FORMAT_S16_LE,
+	.channels = 4,
+	.buffer_size = 16384,
+	.period_size = 2048,
+};
+
+// The minimal period of 4096 bytes, several periods elapse on every tick
+FIXTURE_VARIANT_ADD(pcmtest, s16_stereo_48000_small_period) {
+	.rate = 48000,
+	.format = SND_PCM_FORMAT_S16_LE,
+	.channels = 2,
+	.buffer_size = 16384,
+	.period_size = 1024,
+};
+
 FIXTURE_TEARDOWN(pcmtest) {
 }
 
 FIXTURE_SETUP(pcmtest) {
-	char *card_name;
 	int err;
 
 	if (geteuid())
@@ -135,29 +443,19 @@ FIXTURE_SETUP(pcmtest) {
 	if (err)
 		SKIP(exit(-1), "Can't read patterns. Probably, module isn't loaded");
 
-	card_name = malloc(127);
-	ASSERT_NE(card_name, NULL);
-	self->params.buffer_size = 16384;
-	self->params.period_size = 4096;
-	self->params.channels = CH_NUM;
-	self->params.rate = 8000;
+	self->params.buffer_size = variant->buffer_size;
+	self->params.period_size = variant->period_size;
+	self->params.channels = variant->channels;
+	self->params.rate = variant->rate;
 	self->params.access = SND_PCM_ACCESS_RW_INTERLEAVED;
-	self->params.format = SND_PCM_FORMAT_S16_LE;
-	self->card = -1;
+	self->params.format = variant->format;
 	self->params.sample_size = snd_pcm_format_physical_width(self->params.format) / 8;
 
 	self->params.sec_buf_len = get_sec_buf_len(self->params.rate, self->params.channels,
 						   self->params.format);
-	self->params.time = 4;
+	self->params.time = 2;
 
-	while (snd_card_next(&self->card) >= 0) {
-		if (self->card == -1)
-			break;
-		snd_card_get_name(self->card, &card_name);
-		if (!strcmp(card_name, "PCM-Test"))
-			break;
-	}
-	free(card_name);
+	self->card = find_card();
 	ASSERT_NE(self->card, -1);
 }
 
@@ -171,6 +469,7 @@ TEST_F(pcmtest, playback) {
 	size_t write_res;
 	int test_results;
 	int i, cur_ch, pos_in_ch;
+	double cpu_start;
 	void *samples;
 	struct pcmtest_test_params *params = &self->params;
 
@@ -186,13 +485,16 @@ TEST_F(pcmtest, playback) {
 				   params->rate * params->channels * params->time);
 	it = samples;
 	for (i = 0; i < self->params.sec_buf_len * params->time; i++) {
-		cur_ch = (i / params->sample_size) % CH_NUM;
-		pos_in_ch = i / params->sample_size / CH_NUM * params->sample_size
+		cur_ch = (i / params->sample_size) % params->channels;
+		pos_in_ch = i / params->sample_size / params->channels * params->sample_size
 			    + (i % params->sample_size);
+		cur_ch %= PATTERN_NUM;
 		it[i] = patterns[cur_ch].buf[pos_in_ch % patterns[cur_ch].len];
 	}
+	cpu_start = cpu_time_ms();
 	write_res = snd_pcm_writei(handle, samples, params->rate * params->time);
 	ASSERT_GE(write_res, 0);
+	report_cpu("RW interleaved playback", cpu_start, params->sec_buf_len * params->time);
 
 	snd_pcm_close(handle);
 	free(samples);
@@ -210,6 +512,7 @@ TEST_F(pcmtest, capture) {
 	unsigned char *it;
 	size_t read_res;
 	int i, cur_ch, pos_in_ch;
+	double cpu_start;
 	void *samples;
 	struct pcmtest_test_params *params = &self->params;
 
@@ -223,14 +526,17 @@ TEST_F(pcmtest, capture) {
 			       params, self->card, SND_PCM_STREAM_CAPTURE), 0);
 	snd_pcm_format_set_silence(params->format, samples,
 				   params->rate * params->channels * params->time);
+	cpu_start = cpu_time_ms();
 	read_res = snd_pcm_readi(handle, samples, params->rate * params->time);
 	ASSERT_GE(read_res, 0);
+	report_cpu("RW interleaved capture", cpu_start, params->sec_buf_len * params->time);
 	snd_pcm_close(handle);
 	it = (unsigned char *)samples;
 	for (i = 0; i < self->params.sec_buf_len * self->params.time; i++) {
-		cur_ch = (i / params->sample_size) % CH_NUM;
-		pos_in_ch = i / params->sample_size / CH_NUM * params->sample_size
+		cur_ch = (i / params->sample_size) % params->channels;
+		pos_in_ch = i / params->sample_size / params->channels * params->sample_size
 			    + (i % params->sample_size);
+		cur_ch %= PATTERN_NUM;
 		ASSERT_EQ(it[i], patterns[cur_ch].buf[pos_in_ch % patterns[cur_ch].len]);
 	}
 	free(samples);
@@ -240,10 +546,12 @@ TEST_F(pcmtest, capture) {
 TEST_F(pcmtest, ni_capture) {
 	snd_pcm_t *handle;
 	struct pcmtest_test_params params = self->params;
+	struct pattern_buf *pattern;
 	char **chan_samples;
 	size_t i, j, read_res;
+	double cpu_start;
 
-	chan_samples = calloc(CH_NUM, sizeof(*chan_samples));
+	chan_samples = calloc(params.channels, sizeof(*chan_samples));
 	ASSERT_NE(chan_samples, NULL);
 
 	snd_pcm_sw_params_alloca(&self->swparams);
@@ -254,18 +562,21 @@ TEST_F(pcmtest, ni_capture) {
 	ASSERT_EQ(setup_handle(&handle, self->swparams, self->hwparams,
 			       &params, self->card, SND_PCM_STREAM_CAPTURE), 0);
 
-	for (i = 0; i < CH_NUM; i++)
+	for (i = 0; i < params.channels; i++)
 		chan_samples[i] = calloc(params.sec_buf_len * params.time, 1);
 
+	cpu_start = cpu_time_ms();
 	for (i = 0; i < 1; i++) {
 		read_res = snd_pcm_readn(handle, (void **)chan_samples, params.rate * params.time);
 		ASSERT_GE(read_res, 0);
 	}
+	report_cpu("RW non-interleaved capture", cpu_start, params.sec_buf_len * params.time);
 	snd_pcm_close(handle);
 
-	for (i = 0; i < CH_NUM; i++) {
-		for (j = 0; j < params.rate * params.time; j++)
-			ASSERT_EQ(chan_samples[i][j], patterns[i].buf[j % patterns[i].len]);
+	for (i = 0; i < params.channels; i++) {
+		pattern = &patterns[i % PATTERN_NUM];
+		for (j = 0; j < params.rate * params.time * params.sample_size; j++)
+			ASSERT_EQ(chan_samples[i][j], pattern->buf[j % pattern->len]);
 		free(chan_samples[i]);
 	}
 	free(chan_samples);
@@ -274,11 +585,13 @@ TEST_F(pcmtest, ni_capture) {
 TEST_F(pcmtest, ni_playback) {
 	snd_pcm_t *handle;
 	struct pcmtest_test_params params = self->params;
+	struct pattern_buf *pattern;
 	char **chan_samples;
 	size_t i, j, read_res;
+	double cpu_start;
 	int test_res;
 
-	chan_samples = calloc(CH_NUM, sizeof(*chan_samples));
+	chan_samples = calloc(params.channels, sizeof(*chan_samples));
 	ASSERT_NE(chan_samples, NULL);
 
 	snd_pcm_sw_params_alloca(&self->swparams);
@@ -289,26 +602,321 @@ TEST_F(pcmtest, ni_playback) {
 	ASSERT_EQ(setup_handle(&handle, self->swparams, self->hwparams,
 			       &params, self->card, SND_PCM_STREAM_PLAYBACK), 0);
 
-	for (i = 0; i < CH_NUM; i++) {
+	for (i = 0; i < params.channels; i++) {
+		pattern = &patterns[i % PATTERN_NUM];
 		chan_samples[i] = calloc(params.sec_buf_len * params.time, 1);
 		for (j = 0; j < params.sec_buf_len * params.time; j++)
-			chan_samples[i][j] = patterns[i].buf[j % patterns[i].len];
+			chan_samples[i][j] = pattern->buf[j % pattern->len];
 	}
 
+	cpu_start = cpu_time_ms();
 	for (i = 0; i < 1; i++) {
 		read_res = snd_pcm_writen(handle, (void **)chan_samples, params.rate * params.time);
 		ASSERT_GE(read_res, 0);
 	}
+	report_cpu("RW non-interleaved playback", cpu_start, params.sec_buf_len * params.time);
 
 	snd_pcm_close(handle);
 	test_res = get_test_results("pc_test");
 	ASSERT_EQ(test_res, 1);
 
-	for (i = 0; i < CH_NUM; i++)
+	for (i = 0; i < params.channels; i++)
+		free(chan_samples[i]);
+	free(chan_samples);
+}
+
+/*
+ * The same checks as above, but the data is transferred through the mmap-ed DMA buffer. The
+ * CPU time per MB can be compared with the RW tests of the same variant.
+ */
+TEST_F(pcmtest, mmap_playback) {
+	struct pcmtest_test_params params = self->params;
+	size_t i, bytes = params.sec_buf_len * params.time;
+	snd_pcm_t *handle;
+	unsigned char *samples;
+	double cpu_start;
+
+	samples = malloc(bytes);
+	ASSERT_NE(samples, NULL);
+	for (i = 0; i < bytes; i++)
+		samples[i] = pattern_byte_i(&params, patterns, i);
+
+	snd_pcm_sw_params_alloca(&self->swparams);
+	snd_pcm_hw_params_alloca(&self->hwparams);
+
+	params.access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	ASSERT_EQ(setup_handle(&handle, self->swparams, self->hwparams, &params,
+			       self->card, SND_PCM_STREAM_PLAYBACK), 0);
+	cpu_start = cpu_time_ms();
+	ASSERT_EQ(mmap_transfer(handle, &params, (void **)&samples, params.rate * params.time,
+				SND_PCM_STREAM_PLAYBACK), 0);
+	report_cpu("mmap interleaved playback", cpu_start, bytes);
+	snd_pcm_close(handle);
+	free(samples);
+	ASSERT_EQ(get_test_results("pc_test"), 1);
+}
+
+TEST_F(pcmtest, mmap_capture) {
+	struct pcmtest_test_params params = self->params;
+	size_t i, bytes = params.sec_buf_len * params.time;
+	snd_pcm_t *handle;
+	unsigned char *samples;
+	double cpu_start;
+
+	samples = calloc(bytes, 1);
+	ASSERT_NE(samples, NULL);
+
+	snd_pcm_sw_params_alloca(&self->swparams);
+	snd_pcm_hw_params_alloca(&self->hwparams);
+
+	params.access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+	ASSERT_EQ(setup_handle(&handle, self->swparams, self->hwparams, &params,
+			       self->card, SND_PCM_STREAM_CAPTURE), 0);
+	cpu_start = cpu_time_ms();
+	ASSERT_EQ(mmap_transfer(handle, &params, (void **)&samples, params.rate * params.time,
+				SND_PCM_STREAM_CAPTURE), 0);
+	report_cpu("mmap interleaved capture", cpu_start, bytes);
+	snd_pcm_close(handle);
+	for (i = 0; i < bytes; i++)
+		ASSERT_EQ(samples[i], pattern_byte_i(&params, patterns, i));
+	free(samples);
+}
+
+TEST_F(pcmtest, mmap_ni_playback) {
+	struct pcmtest_test_params params = self->params;
+	size_t i, j, ch_bytes = params.rate * params.time * params.sample_size;
+	struct pattern_buf *pattern;
+	char **chan_samples;
+	snd_pcm_t *handle;
+	double cpu_start;
+
+	chan_samples = calloc(params.channels, sizeof(*chan_samples));
+	ASSERT_NE(chan_samples, NULL);
+	for (i = 0; i < params.channels; i++) {
+		pattern = &patterns[i % PATTERN_NUM];
+		chan_samples[i] = malloc(ch_bytes);
+		ASSERT_NE(chan_samples[i], NULL);
+		for (j = 0; j < ch_bytes; j++)
+			chan_samples[i][j] = pattern->buf[j % pattern->len];
+	}
+
+	snd_pcm_sw_params_alloca(&self->swparams);
+	snd_pcm_hw_params_alloca(&self->hwparams);
+
+	params.access = SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+	ASSERT_EQ(setup_handle(&handle, self->swparams, self->hwparams, &params,
+			       self->card, SND_PCM_STREAM_PLAYBACK), 0);
+	cpu_start = cpu_time_ms();
+	ASSERT_EQ(mmap_transfer(handle, &params, (void **)chan_samples, params.rate * params.time,
+				SND_PCM_STREAM_PLAYBACK), 0);
+	report_cpu("mmap non-interleaved playback", cpu_start, params.sec_buf_len * params.time);
+	snd_pcm_close(handle);
+	ASSERT_EQ(get_test_results("pc_test"), 1);
+
+	for (i = 0; i < params.channels; i++)
+		free(chan_samples[i]);
+	free(chan_samples);
+}
+
+TEST_F(pcmtest, mmap_ni_capture) {
+	struct pcmtest_test_params params = self->params;
+	size_t i, j, ch_bytes = params.rate * params.time * params.sample_size;
+	struct pattern_buf *pattern;
+	char **chan_samples;
+	snd_pcm_t *handle;
+	double cpu_start;
+
+	chan_samples = calloc(params.channels, sizeof(*chan_samples));
+	ASSERT_NE(chan_samples, NULL);
+	for (i = 0; i < params.channels; i++) {
+		chan_samples[i] = calloc(ch_bytes, 1);
+		ASSERT_NE(chan_samples[i], NULL);
+	}
+
+	snd_pcm_sw_params_alloca(&self->swparams);
+	snd_pcm_hw_params_alloca(&self->hwparams);
+
+	params.access = SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+	ASSERT_EQ(setup_handle(&handle, self->swparams, self->hwparams, &params,
+			       self->card, SND_PCM_STREAM_CAPTURE), 0);
+	cpu_start = cpu_time_ms();
+	ASSERT_EQ(mmap_transfer(handle, &params, (void **)chan_samples, params.rate * params.time,
+				SND_PCM_STREAM_CAPTURE), 0);
+	report_cpu("mmap non-interleaved capture", cpu_start, params.sec_buf_len * params.time);
+	snd_pcm_close(handle);
+
+	for (i = 0; i < params.channels; i++) {
+		pattern = &patterns[i % PATTERN_NUM];
+		for (j = 0; j < ch_bytes; j++)
+			ASSERT_EQ(chan_samples[i][j], pattern->buf[j % pattern->len]);
 		free(chan_samples[i]);
+	}
 	free(chan_samples);
 }
 
+static int64_t ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int cmp_s64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Timer ticks of the driver hardware profiles, see 'pcmtst_profiles' in the driver
+static const struct {
+	const char *name;
+	int tick_ms;
+} profile_ticks[] = {
+	{ "default", DEFAULT_TICK_MS },
+	{ "low_latency", 1 },
+	{ "deep_buffer", 50 },
+	{ "multichannel", 10 },
+};
+
+// The module is called snd-pcmtest in the kernel tree and pcmtest when it is built out of tree
+static const char * const profile_params[] = {
+	"/sys/module/snd_pcmtest/parameters/pcm_profiles",
+	"/sys/module/pcmtest/parameters/pcm_profiles",
+};
+
+// Timer tick of the PCM device, the devices without the profile use the default one
+static int profile_tick_ms(int device)
+{
+	char line[256], *name, *pos;
+	FILE *f = NULL;
+	size_t i;
+	int dev;
+
+	for (i = 0; i < sizeof(profile_params) / sizeof(profile_params[0]) && !f; i++)
+		f = fopen(profile_params[i], "r");
+	if (!f)
+		return DEFAULT_TICK_MS;
+	if (!fgets(line, sizeof(line), f))
+		line[0] = '\0';
+	fclose(f);
+
+	pos = line;
+	for (dev = 0; (name = strsep(&pos, ",\n")); dev++) {
+		if (dev != device)
+			continue;
+		for (i = 0; i < sizeof(profile_ticks) / sizeof(profile_ticks[0]); i++)
+			if (!strcmp(name, profile_ticks[i].name))
+				return profile_ticks[i].tick_ms;
+	}
+	return DEFAULT_TICK_MS;
+}
+
+// Print p50/p99/max of the delays (in ns) and return the maximum in us
+static int64_t report_latency(const char *name, int64_t *delays, size_t cnt)
+{
+	if (!cnt)
+		return 0;
+	qsort(delays, cnt, sizeof(*delays), cmp_s64);
+	ksft_print_msg("%s: p50 %lld us, p99 %lld us, max %lld us (%zu periods)\n", name,
+		       (long long)delays[(cnt - 1) / 2] / 1000,
+		       (long long)delays[(cnt - 1) * 99 / 100] / 1000,
+		       (long long)delays[cnt - 1] / 1000, cnt);
+	return delays[cnt - 1] / 1000;
+}
+
+/*
+ * Measure how late the periods elapse against the ideal schedule, which starts at the trigger
+ * timestamp: the period N should end exactly N + 1 periods after it. Three points are measured
+ * for every period: the driver's period elapsed event, the pointer update time reported by
+ * snd_pcm_status and the wakeup of the application. The driver moves the pointer on the timer
+ * ticks, so all of them can be late by up to the tick of the profile. The test fails if the
+ * period events or the wakeups are later than the tick plus one period, and the bound can be
+ * tightened with PCMTEST_LATENCY_BOUND_US.
+ */
+TEST_F(pcmtest, latency) {
+	struct pcmtest_test_params *params = &self->params;
+	size_t i, cnt = params->rate * params->time / params->period_size, woken = 0, events = 0;
+	int64_t *wakeup, *pointer, *driver, trigger = 0, period_ns, bound, wmax, dmax;
+	snd_htimestamp_t htstamp, trigger_ts;
+	struct pcmtest_event ev[64];
+	snd_pcm_status_t *status;
+	struct timespec now;
+	snd_pcm_t *handle;
+	unsigned char *buf;
+	const char *env;
+	ssize_t len;
+	int fd;
+
+	snd_pcm_sw_params_alloca(&self->swparams);
+	snd_pcm_hw_params_alloca(&self->hwparams);
+	snd_pcm_status_alloca(&status);
+	ASSERT_EQ(setup_handle(&handle, self->swparams, self->hwparams, params,
+			       self->card, SND_PCM_STREAM_CAPTURE), 0);
+	// Both the status and the event stream report CLOCK_MONOTONIC timestamps then
+	snd_pcm_sw_params_current(handle, self->swparams);
+	snd_pcm_sw_params_set_tstamp_mode(handle, self->swparams, SND_PCM_TSTAMP_ENABLE);
+	snd_pcm_sw_params_set_tstamp_type(handle, self->swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	ASSERT_EQ(snd_pcm_sw_params(handle, self->swparams), 0);
+	period_ns = params->period_size * 1000000000LL / params->rate;
+	bound = profile_tick_ms(0) * 1000LL + period_ns / 1000;
+	env = getenv(LATENCY_BOUND_ENV);
+	if (env && atoll(env) >= 0 && atoll(env) < bound)
+		bound = atoll(env);
+
+	buf = malloc(params->period_size * params->channels * params->sample_size);
+	wakeup = calloc(cnt, sizeof(*wakeup));
+	pointer = calloc(cnt, sizeof(*pointer));
+	driver = calloc(cnt, sizeof(*driver));
+	ASSERT_NE(buf, NULL);
+	ASSERT_NE(wakeup, NULL);
+	ASSERT_NE(pointer, NULL);
+	ASSERT_NE(driver, NULL);
+
+	// Skip the events of the previous tests
+	fd = open(DEBUG_DIR "/events", O_RDONLY | O_NONBLOCK);
+	ASSERT_GE(fd, 0);
+	while (read(fd, ev, sizeof(ev)) > 0)
+		;
+
+	for (i = 0; i < cnt; i++) {
+		if (snd_pcm_readi(handle, buf, params->period_size) != params->period_size)
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ASSERT_EQ(snd_pcm_status(handle, status), 0);
+		snd_pcm_status_get_htstamp(status, &htstamp);
+		snd_pcm_status_get_trigger_htstamp(status, &trigger_ts);
+		trigger = ts_ns(&trigger_ts);
+		wakeup[i] = ts_ns(&now) - trigger - (i + 1) * period_ns;
+		pointer[i] = ts_ns(&htstamp) - trigger - (i + 1) * period_ns;
+		woken++;
+	}
+	snd_pcm_close(handle);
+
+	while ((len = read(fd, ev, sizeof(ev))) > 0) {
+		for (i = 0; i < len / sizeof(ev[0]); i++) {
+			if (ev[i].type != EVENT_PERIOD || ev[i].stream != SND_PCM_STREAM_CAPTURE ||
+			    ev[i].device || ev[i].number || ev[i].arg >= cnt)
+				continue;
+			driver[events++] = ev[i].ts_ns - trigger - (ev[i].arg + 1LL) * period_ns;
+		}
+	}
+	close(fd);
+	free(buf);
+	ASSERT_EQ(woken, cnt);
+
+	/*
+	 * The pointer timestamp belongs to the last pointer update, which may cover several
+	 * periods, so it can be earlier than the end of the later ones
+	 */
+	dmax = report_latency("driver period event", driver, events);
+	wmax = report_latency("application wakeup", wakeup, woken);
+	report_latency("status pointer update", pointer, woken);
+	EXPECT_LE(dmax, bound);
+	EXPECT_LE(wmax, bound);
+	free(wakeup);
+	free(pointer);
+	free(driver);
+}
+
 /*
  * Here we are testing the custom ioctl definition inside the virtual driver. If it triggers
  * successfully, the driver sets the content of 'ioctl_test' debugfs file to '1'.
@@ -330,4 +938,227 @@ TEST_F(pcmtest, reset_ioctl) {
 	snd_pcm_close(handle);
 }
 
+struct stress_stream {
+	pthread_t thread;
+	int card;
+	int number;
+	snd_pcm_stream_t stream;
+	struct pcmtest_test_params params;
+	struct pattern_buf patts[PATTERN_NUM];	// Patterns of the bank used by the substream
+	struct timespec end;
+	unsigned long long frames;
+	unsigned int xruns;
+	unsigned long long mismatches;		// Capture only, playback is checked by the driver
+	int err;
+};
+
+static int time_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Stream the looped patterns of the substream bank period by period. After an xrun the stream is
+ * prepared again, and both the driver and the thread start the patterns from the beginning.
+ */
+static void *stress_thread(void *data)
+{
+	struct stress_stream *st = data;
+	struct pcmtest_test_params *params = &st->params;
+	size_t frame_bytes = params->channels * params->sample_size;
+	size_t i, pos = 0, chunk = params->period_size * frame_bytes;
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_hw_params_t *hwparams;
+	snd_pcm_sframes_t res = 0;
+	struct timespec now;
+	snd_pcm_t *handle;
+	unsigned char *buf;
+
+	snd_pcm_sw_params_alloca(&swparams);
+	snd_pcm_hw_params_alloca(&hwparams);
+	buf = malloc(chunk);
+	if (!buf) {
+		st->err = -ENOMEM;
+		return NULL;
+	}
+	st->err = setup_handle_sub(&handle, swparams, hwparams, params, st->card, st->number,
+				   st->stream);
+	if (st->err)
+		goto out_free;
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!time_before(&now, &st->end))
+			break;
+		if (st->stream == SND_PCM_STREAM_PLAYBACK) {
+			for (i = 0; i < chunk; i++)
+				buf[i] = pattern_byte_i(params, st->patts, pos + i);
+			res = snd_pcm_writei(handle, buf, params->period_size);
+		} else {
+			res = snd_pcm_readi(handle, buf, params->period_size);
+		}
+		if (res == -EPIPE) {
+			st->xruns++;
+			pos = 0;
+			res = snd_pcm_prepare(handle);
+			if (res < 0)
+				break;
+			continue;
+		}
+		if (res < 0)
+			break;
+		if (st->stream == SND_PCM_STREAM_CAPTURE) {
+			for (i = 0; i < res * frame_bytes; i++)
+				st->mismatches += buf[i] !=
+						  pattern_byte_i(params, st->patts, pos + i);
+		}
+		pos += res * frame_bytes;
+		st->frames += res;
+	}
+	if (res < 0)
+		st->err = res;
+	snd_pcm_close(handle);
+out_free:
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Give every bank its own patterns, so the substreams which use different banks carry different
+ * data. The bank 0 keeps the patterns which the other tests use.
+ */
+static int setup_stress_banks(void)
+{
+	char path[96], patt[64];
+	int bank, i, len;
+
+	for (bank = 1; bank < PATTERN_BANKS; bank++) {
+		for (i = 0; i < PATTERN_NUM; i++) {
+			len = sprintf(patt, "bank %d channel %d %.*s", bank, i, bank * 3 + i,
+				      "0123456789abcdef");
+			sprintf(path, DEBUG_DIR "/bank%d/fill_pattern%d", bank, i);
+			if (write_debug_file(path, patt, len))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+// Set the bank the next stream of the closed substream starts with
+static int set_sub_bank(snd_pcm_stream_t stream, int number, int bank)
+{
+	char path[96], val[8];
+
+	sprintf(path, DEBUG_DIR "/pcm0%c/sub%d/bank",
+		stream == SND_PCM_STREAM_PLAYBACK ? 'p' : 'c', number);
+	return write_debug_file(path, val, sprintf(val, "%d 0", bank));
+}
+
+/*
+ * The stress test changes the patterns of the banks 1-3 and the starting banks of the
+ * substreams, which are the settings kept by the driver, so they are restored for the other tests.
+ */
+FIXTURE(stress) {
+	struct pattern_buf banks[PATTERN_BANKS][PATTERN_NUM];
+};
+
+FIXTURE_SETUP(stress) {
+	int bank;
+
+	if (geteuid())
+		SKIP(return, "This test needs root to run!");
+	if (read_patterns())
+		SKIP(return, "Can't read patterns. Probably, module isn't loaded");
+	for (bank = 1; bank < PATTERN_BANKS; bank++)
+		ASSERT_EQ(read_bank_patterns(bank, self->banks[bank]), 0);
+}
+
+FIXTURE_TEARDOWN(stress) {
+	char path[96];
+	int bank, i;
+
+	for (i = 0; i < SUBSTREAM_CNT; i++) {
+		set_sub_bank(SND_PCM_STREAM_PLAYBACK, i, 0);
+		set_sub_bank(SND_PCM_STREAM_CAPTURE, i, 0);
+	}
+	for (bank = 1; bank < PATTERN_BANKS; bank++) {
+		for (i = 0; i < PATTERN_NUM; i++) {
+			sprintf(path, DEBUG_DIR "/bank%d/fill_pattern%d", bank, i);
+			write_debug_file(path, self->banks[bank][i].buf, self->banks[bank][i].len);
+		}
+	}
+}
+
+/*
+ * Open all the playback and capture substreams of the first device at once and stream the
+ * independent data through each of them from its own thread. The substreams use different
+ * pattern banks, so the data leaking between them is detected as well. The time in seconds
+ * can be set with the PCMTEST_STRESS_TIME environment variable; remember to raise the
+ * kselftest timeout for the long runs.
+ */
+TEST_F(stress, all_substreams) {
+	struct stress_stream streams[SUBSTREAM_CNT * 2], *st;
+	unsigned long long total_bytes = 0;
+	struct timespec start, end;
+	const char *env;
+	char path[96];
+	int card, i, time_sec = STRESS_DEFAULT_TIME;
+	double elapsed;
+
+	ASSERT_EQ(setup_stress_banks(), 0);
+	card = find_card();
+	ASSERT_NE(card, -1);
+
+	env = getenv(STRESS_TIME_ENV);
+	if (env && atoi(env) > 0)
+		time_sec = atoi(env);
+
+	memset(streams, 0, sizeof(streams));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < SUBSTREAM_CNT * 2; i++) {
+		st = &streams[i];
+		st->card = card;
+		st->number = i % SUBSTREAM_CNT;
+		st->stream = i < SUBSTREAM_CNT ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE;
+		st->params.rate = 48000;
+		st->params.channels = 2;
+		st->params.format = SND_PCM_FORMAT_S16_LE;
+		st->params.access = SND_PCM_ACCESS_RW_INTERLEAVED;
+		st->params.buffer_size = 16384;
+		st->params.period_size = 2048;
+		st->params.sample_size = snd_pcm_format_physical_width(st->params.format) / 8;
+		st->end = start;
+		st->end.tv_sec += time_sec;
+		ASSERT_EQ(read_bank_patterns(st->number % PATTERN_BANKS, st->patts), 0);
+		ASSERT_EQ(set_sub_bank(st->stream, st->number, st->number % PATTERN_BANKS), 0);
+	}
+	for (i = 0; i < SUBSTREAM_CNT * 2; i++)
+		ASSERT_EQ(pthread_create(&streams[i].thread, NULL, stress_thread, &streams[i]), 0);
+	for (i = 0; i < SUBSTREAM_CNT * 2; i++)
+		pthread_join(streams[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	for (i = 0; i < SUBSTREAM_CNT * 2; i++) {
+		st = &streams[i];
+		total_bytes += st->frames * st->params.channels * st->params.sample_size;
+		ksft_print_msg("pcm0%c sub%d: %llu frames, %u xruns\n",
+			       st->stream == SND_PCM_STREAM_PLAYBACK ? 'p' : 'c', st->number,
+			       st->frames, st->xruns);
+	}
+	ksft_print_msg("aggregate throughput: %.3f MB/s\n", total_bytes / elapsed / 1024 / 1024);
+
+	for (i = 0; i < SUBSTREAM_CNT * 2; i++) {
+		st = &streams[i];
+		EXPECT_EQ(st->err, 0);
+		EXPECT_NE(st->frames, 0);
+		if (st->stream == SND_PCM_STREAM_CAPTURE) {
+			EXPECT_EQ(st->mismatches, 0);
+			continue;
+		}
+		sprintf(path, DEBUG_DIR "/pcm0p/sub%d/corruption", st->number);
+		EXPECT_EQ(get_debug_stat(path, "mismatched bytes"), 0);
+	}
+}
+
 TEST_HARNESS_MAIN